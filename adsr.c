@@ -19,58 +19,120 @@
  */
 
 #include "adsr.h"
-#include "voice.h"
+#include "synth.h"
 #include <stdlib.h>
 
 /*!
  * Configure the ADSR.
  */
-void adsr_config(struct seq_frame_t* const frame) {
-	cur_voice->adsr.def.release_start = frame->adsr_release_start;
-	cur_voice->adsr.next_event = cur_voice->adsr.def.time_scale = frame->adsr_time_scale_1;
-	cur_voice->adsr.state_counter = ADSR_STATE_INIT; // 1
+void adsr_config(SEQ_CTX_PARAM_ struct seq_frame_t* const frame) {
+	SEQ_CTX cur_voice->adsr.def.release_start = frame->adsr_release_start;
+#ifdef ADSR_TABLE
+	// Index the row once per frame, so the envelope steps don't multiply
+	SEQ_CTX cur_voice->adsr.gains = ADSR_GAINS[frame->adsr_release_start];
+#endif
+	SEQ_CTX cur_voice->adsr.next_event = SEQ_CTX cur_voice->adsr.def.time_scale = frame->adsr_time_scale_1;
+#ifdef SEQ_FEED_COMPENSATE
+	// Fed late: shorten the first step, so the envelope still ends on time
+	if (SEQ_CTX cur_voice->adsr.late) {
+		SEQ_CTX cur_voice->adsr.next_event = SEQ_CTX cur_voice->adsr.late < frame->adsr_time_scale_1 ? frame->adsr_time_scale_1 - SEQ_CTX cur_voice->adsr.late : 0;
+		SEQ_CTX cur_voice->adsr.late = 0;
+	}
+#endif
+	SEQ_CTX cur_voice->adsr.state_counter = ADSR_STATE_INIT; // 1
 	// Start from mute
-	cur_voice->adsr.gain = 6;
+	SEQ_CTX cur_voice->adsr.gain = 6;
 }
 
 /*!
  * Compute the ADSR gain
  */
-void adsr_next() {
-	if (cur_voice->adsr.next_event) {
+void adsr_next(SEQ_CTX_PARAM) {
+	if (SEQ_CTX cur_voice->adsr.next_event) {
 		/* Still waiting for next event */
-		cur_voice->adsr.next_event--;
+		SEQ_CTX cur_voice->adsr.next_event--;
 	} else {
-		if (!cur_voice->adsr.state_counter) {
+		if (!SEQ_CTX cur_voice->adsr.state_counter) {
 			// Abort
-			cur_voice->adsr.gain = 6;
+			SEQ_CTX cur_voice->adsr.gain = 6;
 			return;
 		}
-		if (cur_voice->adsr.state_counter < ADSR_STATE_SUSTAIN_START) {
+#ifdef ADSR_TABLE
+		// A single fetch: the gain of the state, in the row of the envelope
+		SEQ_CTX cur_voice->adsr.gain = SEQ_CTX cur_voice->adsr.gains[SEQ_CTX cur_voice->adsr.state_counter];
+#else
+		if (SEQ_CTX cur_voice->adsr.state_counter < ADSR_STATE_SUSTAIN_START) {
 			// Counter from 1 to 6: 5 steps.
 			// From 6 to 0
-			cur_voice->adsr.gain--;
+			SEQ_CTX cur_voice->adsr.gain--;
 		} 
-		else if (cur_voice->adsr.state_counter < ADSR_STATE_DECAY_START) {
+		else if (SEQ_CTX cur_voice->adsr.state_counter < ADSR_STATE_DECAY_START) {
 			// Remain to zero
 		}
-		else if (cur_voice->adsr.state_counter < cur_voice->adsr.def.release_start) {
+		else if (SEQ_CTX cur_voice->adsr.state_counter < SEQ_CTX cur_voice->adsr.def.release_start) {
 			// Then decay to 1 and stay
-			cur_voice->adsr.gain = 1;
+			SEQ_CTX cur_voice->adsr.gain = 1;
 		}
 		else {
 			// Decrease from 2 to 8 every 8 counters
-			if (!(cur_voice->adsr.state_counter & 0x7)) {
-				cur_voice->adsr.gain++;
+			if (!(SEQ_CTX cur_voice->adsr.state_counter & 0x7)) {
+				SEQ_CTX cur_voice->adsr.gain++;
 			}
-		} 
+		}
+#endif
 
-		if (cur_voice->adsr.state_counter > ADSR_TIME_UNITS) {
+		if (SEQ_CTX cur_voice->adsr.state_counter > ADSR_TIME_UNITS) {
 			// 0 is the final state (fast to check)
-			cur_voice->adsr.state_counter = ADSR_STATE_END;
+			SEQ_CTX cur_voice->adsr.state_counter = ADSR_STATE_END;
 		} else {
-			cur_voice->adsr.next_event = cur_voice->adsr.def.time_scale;
-			cur_voice->adsr.state_counter++;
+			SEQ_CTX cur_voice->adsr.next_event = SEQ_CTX cur_voice->adsr.def.time_scale;
+			SEQ_CTX cur_voice->adsr.state_counter++;
 		}
 	}
 }
+
+void adsr_env_gains(uint8_t envelope, uint8_t* gains) {
+	int release_start = envelope & ADSR_RELEASE_MASK;
+	int shape = envelope >> ADSR_SHAPE_SHIFT;
+	uint8_t gain = 6;
+	gains[ADSR_STATE_END] = 6;
+	// The gain after the event of each state, as the generator steps from ADSR_STATE_INIT
+	for (int counter = ADSR_STATE_INIT; counter <= ADSR_TIME_UNITS + 1; counter++) {
+		if (shape == ADSR_SHAPE_DEFAULT) {
+			// Same steps of the generator without table (the release can go past the mute)
+			if (counter < ADSR_STATE_SUSTAIN_START) {
+				gain--;
+			} else if (counter < ADSR_STATE_DECAY_START) {
+			} else if (counter < release_start) {
+				gain = 1;
+			} else if (!(counter & 0x7)) {
+				gain++;
+			}
+		} else if (counter < release_start) {
+			if (shape == ADSR_SHAPE_PLUCK) {
+				// Full at once, then half every 16 units
+				gain = counter == ADSR_STATE_INIT ? 0 : gain + !(counter & 0xf);
+			} else if (shape == ADSR_SHAPE_ORGAN) {
+				gain = 0;
+			} else if (!(counter & 0x3) && gain > 0) {
+				// Swell: double every 4 units
+				gain--;
+			}
+		} else if (gain < 6) {
+			// Release: half every 4 units (pluck), 2 units (organ) or 8 units (swell)
+			int step = shape == ADSR_SHAPE_PLUCK ? 0x3 : (shape == ADSR_SHAPE_ORGAN ? 0x1 : 0x7);
+			gain += !(counter & step);
+		}
+		gains[counter] = gain;
+	}
+}
+
+#ifdef ADSR_TABLE
+uint8_t adsr_gains[1 << 8][ADSR_ENV_LENGTH];
+
+void adsr_gains_init(void) {
+	for (int envelope = 0; envelope < (1 << 8); envelope++) {
+		adsr_env_gains(envelope, adsr_gains[envelope]);
+	}
+}
+#endif
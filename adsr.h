@@ -33,15 +33,44 @@
 #define ADSR_STATE_RELEASE_DURATION (6 * 8)
 #define ADSR_STATE_END				0
 
+/*! Gains of an envelope, indexed by the state counter (`ADSR_STATE_END` included) */
+#define ADSR_ENV_LENGTH				(ADSR_TIME_UNITS + 2)
+
+/*
+ * Envelope shapes, in the upper bits of the frame `adsr_release_start` (only with ADSR_TABLE).
+ * The default one is the attack, hold, decay and release of the original generator.
+ */
+#define ADSR_SHAPE_SHIFT			6
+#define ADSR_RELEASE_MASK			((1 << ADSR_SHAPE_SHIFT) - 1)
+#define ADSR_SHAPE_DEFAULT			0
+/*! Instant attack, slow decay, fast release */
+#define ADSR_SHAPE_PLUCK			1
+/*! Instant attack, full sustain, fast release */
+#define ADSR_SHAPE_ORGAN			2
+/*! Slow attack, full sustain, release */
+#define ADSR_SHAPE_SWELL			3
+#define ADSR_SHAPE_COUNT			4
+
 #include "poly_cfg.h"
 
+#ifdef ADSR_TABLE
+/*!
+ * Gain tables of the envelopes, as `ADSR_GAINS[envelope][state_counter]`: the generated tune
+ * defines its own (a row per envelope of the tune), otherwise all the envelopes are used.
+ */
+#ifndef ADSR_GAINS
+#define ADSR_GAINS adsr_gains
+extern uint8_t adsr_gains[1 << 8][ADSR_ENV_LENGTH];
+#endif
+#endif
+
 /*!
  * ADSR Envelope Generator definition.
  */
 struct adsr_env_def_t {
 	/*! Time scale, samples per unit. */
 	TIME_SCALE_T time_scale;
-	/*! When the release period starts, time units over the ADSR_TIME_UNITS scale */
+	/*! When the release period starts, time units over the ADSR_TIME_UNITS scale (the `ADSR_GAINS` row with ADSR_TABLE) */
 	uint8_t release_start;
 };
 
@@ -57,16 +86,32 @@ struct adsr_env_gen_t {
 	uint8_t state_counter;
 	/*! Present negative gain (0 is max, 1 is half amplitude, so -10dB, 2 is -20dB etc...) */
 	uint8_t gain;
+#ifdef ADSR_TABLE
+	/*! Gains of the envelope by state counter: the `ADSR_GAINS` row, resolved when the frame is loaded */
+	const uint8_t* gains;
+#endif
+#ifdef SEQ_FEED_COMPENSATE
+	/*! Samples spent waiting for a frame, after the envelope end */
+	uint8_t late;
+#endif
 };
 
 /*!
  * Configure the ADSR.
  */
-void adsr_config(struct seq_frame_t* const frame);
+void adsr_config(SEQ_CTX_PARAM_ struct seq_frame_t* const frame);
 
 /*!
  * Compute the ADSR gain as bit shift count (0 is full amplitude, 1 is half, etc...)
  */
-void adsr_next();
+void adsr_next(SEQ_CTX_PARAM);
+
+/*! Gains of the envelope (shape and release start of a frame `adsr_release_start`), by state counter: `ADSR_ENV_LENGTH` values */
+void adsr_env_gains(uint8_t envelope, uint8_t* gains);
+
+#ifdef ADSR_TABLE
+/*! Fill the `adsr_gains` table of all the envelopes, before any playback */
+void adsr_gains_init(void);
+#endif
 
 #endif
@@ -19,6 +19,8 @@
  */
 
 #include "codegen.h"
+#include "waveform.h"
+#include "adsr.h"
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
@@ -32,11 +34,331 @@ static void distribution_codegen(FILE *file, const char* var_name, const char* v
     fprintf(file, "\n};\n\n");
 }
 
-int codegen_write(const char* tune_name, struct bit_stream_t* stream, int channel_count, int has_clip) {
+/*! Huffman decode table: count of codes of each length */
+static void code_counts_codegen(FILE *file, const char* var_name, struct ref_map_t* refs) {
+	if (!refs->bit_count) {
+		return;
+	}
+    fprintf(file, "const uint8_t %s[] = {\n\t", var_name);
+    for (int i = 0; i < refs->bit_count; i++) {
+        fprintf(file, "%d, ", refs->code_counts[i]);
+    }
+    fprintf(file, "\n};\n\n");
+}
+
+/*!
+ * Envelope gain tables: a row for each distinct envelope of the tune. The `adsr_release_start`
+ * refs are written as the rows, so the player fetches the gains with the decoded value.
+ */
+static void envelopes_codegen(FILE *file, struct ref_map_t* refs) {
+	int* envelopes = malloc(sizeof(int) * (refs->count + 1));
+	struct ref_map_t rows = *refs;
+	rows.values = malloc(sizeof(int) * (refs->count + 1));
+	int envelope_count = 0;
+	for (int i = 0; i < refs->count; i++) {
+		// Tuple tables can repeat the values
+		int row = 0;
+		while (row < envelope_count && envelopes[row] != refs->values[i]) {
+			row++;
+		}
+		if (row == envelope_count) {
+			envelopes[envelope_count++] = refs->values[i];
+		}
+		rows.values[i] = row;
+	}
+	distribution_codegen(file, "tune_adsr_release_start_refs", "uint8_t", &rows);
+
+	uint8_t gains[ADSR_ENV_LENGTH];
+	fprintf(file, "const uint8_t tune_adsr_gains[][%d] = {\n", ADSR_ENV_LENGTH);
+	for (int row = 0; row < envelope_count; row++) {
+		adsr_env_gains(envelopes[row], gains);
+		fprintf(file, "\t// Shape %d, release at %d\n\t{ ", envelopes[row] >> ADSR_SHAPE_SHIFT, envelopes[row] & ADSR_RELEASE_MASK);
+		for (int i = 0; i < ADSR_ENV_LENGTH; i++) {
+			fprintf(file, "%d, ", gains[i]);
+		}
+		fprintf(file, "},\n");
+	}
+	fprintf(file, "};\n\n");
+	free(rows.values);
+	free(envelopes);
+}
+
+/*!
+ * The single positive amplitude of the tune, or 0 if more. A zero amplitude is only of the pauses
+ * (the MML volume is 1-128), so it doesn't reach the waveform step.
+ */
+static int constant_amplitude(const struct ref_map_t* refs) {
+	int amplitude = 0;
+	for (int i = 0; i < refs->count; i++) {
+		if (refs->values[i] < 0 || (refs->values[i] && amplitude && refs->values[i] != amplitude)) {
+			return 0;
+		}
+		amplitude = refs->values[i] ? refs->values[i] : amplitude;
+	}
+	return amplitude;
+}
+
+/*!
+ * `seq_feed_synth` specialized for the tune: unrolled for the voices, with constant voice addresses
+ * (`cur_voice` is only set for the envelope and the frame feed), and without the features
+ * the tune doesn't use. Bit-exact with the generic one in `sequencer.c`.
+ */
+static void feed_codegen(FILE *file, struct bit_stream_t* stream, int channel_count, int has_clip, int has_wf_types) {
+	int has_rests = 0;
+	for (int i = 0; i < stream->refs_wf_period.count; i++) {
+		has_rests |= !stream->refs_wf_period.values[i];
+	}
+	// Square waves of a single amplitude: the attenuated samples are a table, instead of the shift loop
+	int amplitude = has_wf_types ? 0 : constant_amplitude(&stream->refs_wf_amplitude);
+	if (amplitude) {
+		fprintf(file, "// The samples of the amplitude %d, by gain: positive, then negative\n", amplitude);
+		fprintf(file, "static const int8_t tune_wf_levels[12] = {\n\t");
+		for (int gain = 0; gain < 12; gain++) {
+			fprintf(file, "%d, ", (int8_t)((gain < 6 ? amplitude : -amplitude) >> (gain % 6)));
+		}
+		fprintf(file, "\n};\n\n");
+	}
+
+	fprintf(file, "// Unrolled for %d voices%s%s%s\n", channel_count, has_rests ? "" : ", no rests",
+		amplitude ? ", constant amplitude" : "", has_clip ? "" : ", no clipping");
+	fprintf(file, "int8_t seq_feed_synth(void) {\n");
+	fprintf(file, "\t%s sample = 0;\n", has_clip ? "int16_t" : "int8_t");
+	if (channel_count > 1) {
+		fprintf(file, "\tuint8_t fed = 0;\n");
+	}
+	for (int i = 0; i < channel_count; i++) {
+		char voice[32];
+		snprintf(voice, sizeof(voice), "synth.voice[%d]", i);
+		fprintf(file, "\n\tcur_voice = &%s;\n", voice);
+		fprintf(file, "\tadsr_next();\n");
+		fprintf(file, "\tif (%s.adsr.gain < 6) {\n", voice);
+		if (has_wf_types) {
+			fprintf(file, "\t\tsample += (int8_t)(voice_wf_next() >> %s.adsr.gain);\n", voice);
+		} else {
+			const char* indent = has_rests ? "\t\t\t" : "\t\t";
+			if (has_rests) {
+				fprintf(file, "\t\tif (%s.wf.period > 0) {\n", voice);
+			}
+			fprintf(file, "%sif ((%s.wf.period_remain >> PERIOD_FP_SCALE) == 0) {\n", indent, voice);
+			fprintf(file, "%s\t%s.wf.int_sample = -%s.wf.int_sample;\n", indent, voice, voice);
+			fprintf(file, "%s\t%s.wf.period_remain += %s.wf.period;\n", indent, voice, voice);
+			fprintf(file, "%s}\n", indent);
+			fprintf(file, "%s%s.wf.period_remain -= (1 << PERIOD_FP_SCALE);\n", indent, voice);
+			if (amplitude) {
+				fprintf(file, "%ssample += tune_wf_levels[%s.wf.int_sample > 0 ? %s.adsr.gain : 6 + %s.adsr.gain];\n", indent, voice, voice, voice);
+			}
+			if (has_rests) {
+				fprintf(file, "\t\t}\n");
+			}
+			if (!amplitude) {
+				fprintf(file, "\t\tsample += (int8_t)(%s.wf.int_sample >> %s.adsr.gain);\n", voice, voice);
+			}
+		}
+		fprintf(file, "\t}\n");
+
+		// Feed a single frame per sample
+		fprintf(file, "\tif (%s%s.adsr.state_counter == ADSR_STATE_END) {\n", i ? "!fed && " : "", voice);
+		fprintf(file, "\t\tnew_frame_require();\n");
+		fprintf(file, "\t\tif (seq_buf_frame.adsr_time_scale_1 == 0) {\n");
+		fprintf(file, "\t\t\tseq_end = 1;\n");
+		if (i < channel_count - 1) {
+			fprintf(file, "\t\t\tgoto mix;\n");
+		} else {
+			fprintf(file, "\t\t} else {\n");
+		}
+		if (i < channel_count - 1) {
+			fprintf(file, "\t\t}\n");
+		}
+		const char* indent = i < channel_count - 1 ? "\t\t" : "\t\t\t";
+		fprintf(file, "%svoice_wf_set(&seq_buf_frame);\n", indent);
+		fprintf(file, "%sadsr_config(&seq_buf_frame);\n", indent);
+		if (i < channel_count - 1) {
+			fprintf(file, "\t\tfed = 1;\n");
+		} else {
+			fprintf(file, "\t\t}\n");
+		}
+		fprintf(file, "\t}");
+		if (stream->options & SEQ_COMPILE_COMPENSATE) {
+			fprintf(file, " else if (%s.adsr.state_counter == ADSR_STATE_END && %s.adsr.late < UINT8_MAX) {\n", voice, voice);
+			fprintf(file, "\t\t%s.adsr.late++;\n", voice);
+			fprintf(file, "\t}");
+		}
+		fprintf(file, "\n");
+	}
+
+	if (channel_count > 1) {
+		fprintf(file, "\nmix:\n");
+	} else {
+		fprintf(file, "\n");
+	}
+	if (has_clip) {
+		fprintf(file, "\tif (sample > INT8_MAX) {\n\t\tsample = INT8_MAX;\n\t} else if (sample < INT8_MIN) {\n\t\tsample = INT8_MIN;\n\t}\n");
+	}
+	fprintf(file, "\treturn sample;\n}\n\n");
+}
+
+/*!
+ * Emit the byte `value` shifted right by `shift` (left if negative), as zero-filled 8-bit value:
+ * with a nibble swap for the shifts over 4, and a mask
+ */
+static void shift_codegen(FILE *file, const char* value, int shift) {
+	if (shift > 4) {
+		fprintf(file, "((uint8_t)(TUNE_SWAP(%s) >> %d) & 0x%x)", value, shift - 4, 0xff >> shift);
+	} else if (shift > 0) {
+		fprintf(file, "(%s >> %d)", value, shift);
+	} else if (shift < -4) {
+		fprintf(file, "(uint8_t)((TUNE_SWAP(%s) & 0xf0) << %d)", value, -shift - 4);
+	} else {
+		fprintf(file, "(uint8_t)(%s << %d)", value, -shift);
+	}
+}
+
+/*! Emit the read of the `bits` field at the bit `offset` of the frame, with constant shifts and masks */
+static void field_codegen(FILE *file, const char* ref_name, int offset, int bits) {
+	char low[32], high[32];
+	snprintf(low, sizeof(low), "tune_decode_ptr[%d]", offset / 8);
+	snprintf(high, sizeof(high), "tune_decode_ptr[%d]", offset / 8 + 1);
+	int shift = offset % 8;
+	int mask = (1 << bits) - 1;
+
+	fprintf(file, "\t\t%s = ", ref_name);
+	if (shift + bits > 8) {
+		// Across two bytes
+		fprintf(file, "(");
+		shift_codegen(file, low, shift);
+		fprintf(file, " | ");
+		shift_codegen(file, high, shift - 8);
+		fprintf(file, bits < 8 ? ") & 0x%x" : ")", mask);
+	} else if (shift > 4) {
+		fprintf(file, "(uint8_t)(TUNE_SWAP(%s) >> %d) & 0x%x", low, shift - 4, mask);
+	} else {
+		fprintf(file, shift ? "(%s >> %d)" : "%s", low, shift);
+		if (shift + bits < 8) {
+			fprintf(file, " & 0x%x", mask);
+		}
+	}
+	fprintf(file, ";\n");
+}
+
+/*!
+ * Frame decoder specialized for the bit phases of a fixed-width stream (not Huffman nor back-referenced).
+ * The frame is a constant count of bits, so its start cycles through 8 bit phases at most:
+ * every phase reads the fields at constant offsets, without the variable shifts of `read_bits`.
+ */
+static void decode_codegen(FILE *file, struct bit_stream_t* stream) {
+	const char* names[STREAM_FIELD_COUNT] = { "adsr_time_scale", "wf_period", "wf_amplitude", "adsr_release_start", "wf_type", "wf_step" };
+	const char* frame_fields[STREAM_FIELD_COUNT] = { "adsr_time_scale_1", "wf_period", "wf_amplitude", "adsr_release_start", "wf_type", "wf_step" };
+	struct ref_map_t* columns[STREAM_FIELD_COUNT] = { &stream->refs_adsr_time_scale, &stream->refs_wf_period, &stream->refs_wf_amplitude, &stream->refs_adsr_release_start, &stream->refs_wf_type, &stream->refs_wf_step };
+	int field_count = stream_field_count(stream);
+	int tuples = stream->options & STREAM_TUPLES;
+
+	// Fields read per frame: the tuple ref, or the columns with more than a value
+	const char* read_names[STREAM_FIELD_COUNT];
+	int read_bits[STREAM_FIELD_COUNT];
+	int read_count = 0;
+	int frame_bits = 0;
+	if (tuples) {
+		read_names[read_count] = "ref_frame";
+		read_bits[read_count++] = stream->refs_frame.bit_count;
+	} else {
+		for (int i = 0; i < field_count; i++) {
+			if (columns[i]->bit_count) {
+				read_names[read_count] = names[i];
+				read_bits[read_count++] = columns[i]->bit_count;
+			}
+		}
+	}
+	for (int i = 0; i < read_count; i++) {
+		frame_bits += read_bits[i];
+	}
+
+	// Phases reached from the stream start
+	int phases[8];
+	int phase_count = 0;
+	for (int phase = 0; phase_count == 0 || phase != phases[0]; phase = (phase + frame_bits) % 8) {
+		phases[phase_count++] = phase;
+	}
+
+	fprintf(file, "// Frame decoder of the %d-bit frames, for %d bit phases\n", frame_bits, phase_count);
+	fprintf(file, "#define TUNE_SWAP(b) ((uint8_t)((b) << 4 | (b) >> 4))\n\n");
+	fprintf(file, "static const uint8_t* tune_decode_ptr;\n");
+	if (phase_count > 1) {
+		fprintf(file, "static uint8_t tune_decode_phase;\n");
+	}
+	fprintf(file, "\nvoid tune_decode_reset(void) {\n");
+	fprintf(file, "\ttune_decode_ptr = tune_data;\n");
+	if (phase_count > 1) {
+		fprintf(file, "\ttune_decode_phase = 0;\n");
+	}
+	fprintf(file, "}\n\n");
+
+	fprintf(file, "void tune_frame_decode(void) {\n");
+	for (int i = 0; i < read_count; i++) {
+		fprintf(file, "\tuint8_t %s%s;\n", tuples ? "" : "ref_", read_names[i]);
+	}
+	if (phase_count > 1) {
+		fprintf(file, "\tswitch (tune_decode_phase) {\n");
+	}
+	for (int p = 0; p < phase_count; p++) {
+		if (phase_count > 1) {
+			fprintf(file, "\tcase %d:\n", phases[p]);
+		} else {
+			fprintf(file, "\t{\n");
+		}
+		int offset = phases[p];
+		for (int i = 0; i < read_count; i++) {
+			char ref_name[32];
+			snprintf(ref_name, sizeof(ref_name), "%s%s", tuples ? "" : "ref_", read_names[i]);
+			field_codegen(file, ref_name, offset, read_bits[i]);
+			offset += read_bits[i];
+		}
+		if (offset / 8) {
+			fprintf(file, "\t\ttune_decode_ptr += %d;\n", offset / 8);
+		}
+		if (phase_count > 1) {
+			fprintf(file, "\t\ttune_decode_phase = %d;\n", offset % 8);
+			fprintf(file, "\t\tbreak;\n");
+		}
+	}
+	fprintf(file, "\t}\n\n");
+
+	const char* indent = "\t";
+	if (!(stream->options & STREAM_END_FRAME)) {
+		// The stream ends at the last byte, with zero refs
+		fprintf(file, "\tif (tune_decode_ptr >= tune_data + TUNE_DATA_SIZE - 2");
+		for (int i = 0; i < read_count; i++) {
+			fprintf(file, " && !ref_%s", read_names[i]);
+		}
+		fprintf(file, ") {\n");
+		fprintf(file, "\t\tseq_buf_frame.adsr_time_scale_1 = 0;\n");
+		fprintf(file, "\t\treturn;\n");
+		fprintf(file, "\t}\n");
+	}
+	for (int i = 0; i < field_count; i++) {
+		char ref_name[32];
+		if (tuples) {
+			snprintf(ref_name, sizeof(ref_name), "ref_frame");
+		} else if (columns[i]->bit_count) {
+			snprintf(ref_name, sizeof(ref_name), "ref_%s", names[i]);
+		} else {
+			snprintf(ref_name, sizeof(ref_name), "0");
+		}
+		fprintf(file, "%sseq_buf_frame.%s = tune_%s_refs[%s];\n", indent, frame_fields[i], names[i], ref_name);
+	}
+	fprintf(file, "}\n\n");
+}
+
+int codegen_write(const char* tune_name, const char* out_name, struct bit_stream_t* stream, int channel_count, int has_clip, FILE* log) {
+	char file_name[FILENAME_MAX];
+	// The header is included by name, from the same folder
+	const char* header_name = strrchr(out_name, '/');
+	header_name = header_name ? header_name + 1 : out_name;
+
     // Prepare the header for tune_gen.h (with dynamic bit sizes)
-	FILE *hSrc = fopen("tune_gen.h", "w");
+	snprintf(file_name, sizeof(file_name), "%s.h", out_name);
+	FILE *hSrc = fopen(file_name, "w");
 	if (!hSrc) {
-		fprintf(stderr, "Cannot write the tune_gen.h file\n");
+		fprintf(stderr, "Cannot write the %s file\n", file_name);
 		return 1;
 	}
 
@@ -45,41 +367,164 @@ int codegen_write(const char* tune_name, struct bit_stream_t* stream, int channe
 	fprintf(hSrc, "// Auto-generated code. Don't modify\n");
 	fprintf(hSrc, "// Tune: %s\n\n", tune_name);
 
-	fprintf(hSrc, "#define BITS_ADSR_TIME_SCALE %d\n", stream->refs_adsr_time_scale.bit_count);
-	fprintf(hSrc, "#define BITS_WF_PERIOD %d\n", stream->refs_wf_period.bit_count);
-	fprintf(hSrc, "#define BITS_WF_AMPLITUDE %d\n", stream->refs_wf_amplitude.bit_count);
-	fprintf(hSrc, "#define BITS_ADSR_RELEASE_START %d\n\n", stream->refs_adsr_release_start.bit_count);
+	// Only the generators used by the tune are compiled in the synth: square-only tunes don't code the generator
+	int wf_types = stream_wf_types(stream);
+	int has_wf_types = (wf_types & ~(1 << WF_SQUARE)) != 0;
+	int has_wf_steps = stream_field_count(stream) == STREAM_FIELD_COUNT;
+	if (wf_types & (1 << WF_SAWTOOTH)) {
+		fprintf(hSrc, "#define WAVEFORM_SAWTOOTH\n");
+	}
+	if (wf_types & (1 << WF_TRIANGLE)) {
+		fprintf(hSrc, "#define WAVEFORM_TRIANGLE\n");
+	}
+	if (wf_types & (1 << WF_NOISE)) {
+		fprintf(hSrc, "#define WAVEFORM_NOISE\n");
+	}
+	if (has_wf_types) {
+		fprintf(hSrc, "\n");
+	}
+
+	// Table-driven envelopes, with the gain tables of the tune, only for the envelope shapes
+	int has_env_table = stream_envelope_count(stream) > 0;
+	if (has_env_table) {
+		fprintf(hSrc, "#define ADSR_TABLE\n");
+		fprintf(hSrc, "#define ADSR_GAINS tune_adsr_gains\n\n");
+	}
 
+	if (stream->options & STREAM_TUPLES) {
+		// A single ref per frame, indexing all the *_refs tables
+		fprintf(hSrc, "#define TUNE_TUPLES\n");
+		fprintf(hSrc, "#define BITS_FRAME %d\n\n", stream->refs_frame.bit_count);
+	} else {
+		fprintf(hSrc, "#define BITS_ADSR_TIME_SCALE %d\n", stream->refs_adsr_time_scale.bit_count);
+		fprintf(hSrc, "#define BITS_WF_PERIOD %d\n", stream->refs_wf_period.bit_count);
+		fprintf(hSrc, "#define BITS_WF_AMPLITUDE %d\n", stream->refs_wf_amplitude.bit_count);
+		fprintf(hSrc, "#define BITS_ADSR_RELEASE_START %d\n", stream->refs_adsr_release_start.bit_count);
+		if (has_wf_types) {
+			fprintf(hSrc, "#define BITS_WF_TYPE %d\n", stream->refs_wf_type.bit_count);
+		}
+		if (has_wf_steps) {
+			fprintf(hSrc, "#define BITS_WF_STEP %d\n", stream->refs_wf_step.bit_count);
+		}
+		fprintf(hSrc, "\n");
+	}
+
+	if (stream->options & STREAM_HUFFMAN) {
+		// BITS_* are then the longest code lengths
+		fprintf(hSrc, "#define TUNE_HUFFMAN\n");
+	}
+	if (stream->options & STREAM_BACKREF) {
+		fprintf(hSrc, "#define TUNE_BACKREF\n");
+		fprintf(hSrc, "#define TUNE_BACKREF_LENGTH_BITS %d\n", STREAM_BACKREF_LENGTH_BITS);
+		fprintf(hSrc, "#define TUNE_BACKREF_OFFSET_BITS %d\n", stream->backref_offset_bits);
+	}
+	if (stream->options & STREAM_END_FRAME) {
+		// Back-references and end frame
+		fprintf(hSrc, "#define TUNE_END_FRAME\n");
+		fprintf(hSrc, "#define TUNE_ESCAPE_REF %d\n", stream->escape_ref);
+	}
 	fprintf(hSrc, "#define TUNE_DATA_SIZE %d\n", stream->data_size);
 	if (!has_clip) {
 		fprintf(hSrc, "#define NO_CLIP_CHECK\n");
 	}
+	if (stream->options & SEQ_COMPILE_COMPENSATE) {
+		// The stream order relies on the compensated timing
+		fprintf(hSrc, "#define SEQ_FEED_COMPENSATE\n");
+	}
+	// The phase decoder reads fixed-width fields only
+	int decode_unrolled = (stream->options & SEQ_CODEGEN_UNROLL) && !(stream->options & (STREAM_HUFFMAN | STREAM_BACKREF));
+	if (stream->options & SEQ_CODEGEN_UNROLL) {
+		// seq_feed_synth is in the tune sources
+		fprintf(hSrc, "#define SEQ_FEED_UNROLLED\n");
+	}
+	if (decode_unrolled) {
+		fprintf(hSrc, "#define TUNE_DECODE_UNROLLED\n");
+	}
 	fprintf(hSrc, "#define SEQ_CHANNEL_COUNT %d\n\n", channel_count);
 
     fprintf(hSrc, "extern const uint16_t tune_adsr_time_scale_refs[];\n");
     fprintf(hSrc, "extern const uint16_t tune_wf_period_refs[];\n");
     fprintf(hSrc, "extern const int8_t tune_wf_amplitude_refs[];\n");
     fprintf(hSrc, "extern const uint8_t tune_adsr_release_start_refs[];\n");
+    if (has_env_table) {
+        fprintf(hSrc, "extern const uint8_t tune_adsr_gains[][%d];\n", ADSR_ENV_LENGTH);
+    }
+    if (has_wf_types) {
+        fprintf(hSrc, "extern const uint8_t tune_wf_type_refs[];\n");
+    }
+    if (has_wf_steps) {
+        fprintf(hSrc, "extern const int16_t tune_wf_step_refs[];\n");
+    }
+    if ((stream->options & STREAM_HUFFMAN) && (stream->options & STREAM_TUPLES)) {
+        fprintf(hSrc, "extern const uint8_t tune_frame_codes[];\n");
+    } else if (stream->options & STREAM_HUFFMAN) {
+        fprintf(hSrc, "extern const uint8_t tune_adsr_time_scale_codes[];\n");
+        fprintf(hSrc, "extern const uint8_t tune_wf_period_codes[];\n");
+        fprintf(hSrc, "extern const uint8_t tune_wf_amplitude_codes[];\n");
+        fprintf(hSrc, "extern const uint8_t tune_adsr_release_start_codes[];\n");
+        if (has_wf_types) {
+            fprintf(hSrc, "extern const uint8_t tune_wf_type_codes[];\n");
+        }
+        if (has_wf_steps) {
+            fprintf(hSrc, "extern const uint8_t tune_wf_step_codes[];\n");
+        }
+    }
     fprintf(hSrc, "extern const uint8_t tune_data[TUNE_DATA_SIZE];\n\n");
+    if (decode_unrolled) {
+        fprintf(hSrc, "void tune_decode_reset(void);\n");
+        fprintf(hSrc, "void tune_frame_decode(void);\n\n");
+    }
 
-	printf("File tune_gen.h written\n");
+	if (log) {
+		fprintf(log, "File %s written\n", file_name);
+	}
 	fclose(hSrc);
 
 	// Save the compiled output to tune_gen.c (table sources)
-	FILE *cSrc = fopen("tune_gen.c", "w");
+	snprintf(file_name, sizeof(file_name), "%s.c", out_name);
+	FILE *cSrc = fopen(file_name, "w");
 	if (!cSrc) {
-		fprintf(stderr, "Cannot write the tune_gen.c file\n");
+		fprintf(stderr, "Cannot write the %s file\n", file_name);
 		return 1;
 	}
-	fprintf(cSrc, "#include \"tune_gen.h\"\n\n");
+	fprintf(cSrc, "#include \"%s.h\"\n", header_name);
+	if (stream->options & SEQ_CODEGEN_UNROLL) {
+		fprintf(cSrc, "#include \"synth.h\"\n");
+	}
+	fprintf(cSrc, "\n");
 
-	fprintf(hSrc, "// Auto-generated code. Don't modify\n");
+	fprintf(cSrc, "// Auto-generated code. Don't modify\n");
 	fprintf(cSrc, "// Tune: %s\n\n", tune_name);
 
     distribution_codegen(cSrc, "tune_adsr_time_scale_refs", "uint16_t", &stream->refs_adsr_time_scale);
     distribution_codegen(cSrc, "tune_wf_period_refs", "uint16_t", &stream->refs_wf_period);
     distribution_codegen(cSrc, "tune_wf_amplitude_refs", "int8_t", &stream->refs_wf_amplitude);
-    distribution_codegen(cSrc, "tune_adsr_release_start_refs", "uint8_t", &stream->refs_adsr_release_start);
+    if (has_env_table) {
+        envelopes_codegen(cSrc, &stream->refs_adsr_release_start);
+    } else {
+        distribution_codegen(cSrc, "tune_adsr_release_start_refs", "uint8_t", &stream->refs_adsr_release_start);
+    }
+    if (has_wf_types) {
+        distribution_codegen(cSrc, "tune_wf_type_refs", "uint8_t", &stream->refs_wf_type);
+    }
+    if (has_wf_steps) {
+        distribution_codegen(cSrc, "tune_wf_step_refs", "int16_t", &stream->refs_wf_step);
+    }
+
+    if ((stream->options & STREAM_HUFFMAN) && (stream->options & STREAM_TUPLES)) {
+        code_counts_codegen(cSrc, "tune_frame_codes", &stream->refs_frame);
+    } else if (stream->options & STREAM_HUFFMAN) {
+        code_counts_codegen(cSrc, "tune_adsr_time_scale_codes", &stream->refs_adsr_time_scale);
+        code_counts_codegen(cSrc, "tune_wf_period_codes", &stream->refs_wf_period);
+        code_counts_codegen(cSrc, "tune_wf_amplitude_codes", &stream->refs_wf_amplitude);
+        code_counts_codegen(cSrc, "tune_adsr_release_start_codes", &stream->refs_adsr_release_start);
+        if (has_wf_types) {
+            code_counts_codegen(cSrc, "tune_wf_type_codes", &stream->refs_wf_type);
+        }
+        if (has_wf_steps) {
+            code_counts_codegen(cSrc, "tune_wf_step_codes", &stream->refs_wf_step);
+        }
+    }
 
     fprintf(cSrc, "const uint8_t tune_data[TUNE_DATA_SIZE] = {\n\t");
 	for (int i = 0; i < stream->data_size; i++) {
@@ -90,7 +535,15 @@ int codegen_write(const char* tune_name, struct bit_stream_t* stream, int channe
 	}
 
 	fprintf(cSrc, "\n};\n\n");
-	printf("File tune_gen.c written\n");
+	if (stream->options & SEQ_CODEGEN_UNROLL) {
+		feed_codegen(cSrc, stream, channel_count, has_clip, has_wf_types);
+	}
+	if (decode_unrolled) {
+		decode_codegen(cSrc, stream);
+	}
+	if (log) {
+		fprintf(log, "File %s written\n", file_name);
+	}
 	fclose(cSrc);
 
 	return 0;
@@ -22,7 +22,7 @@
 
 #include "sequencer.h"
 
-/*! Write the source code with the stream data */
-int codegen_write(const char* tune_name, struct bit_stream_t* stream, int channel_count, int do_clip_check);
+/*! Write the source code with the stream data, to `<out_name>.h` and `<out_name>.c`, and report the written files to `log` (if not NULL) */
+int codegen_write(const char* tune_name, const char* out_name, struct bit_stream_t* stream, int channel_count, int do_clip_check, FILE* log);
 
 #endif
\ No newline at end of file
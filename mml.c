@@ -29,45 +29,61 @@
 /*!
  * Not optimized for microcontroller usage.
  * Requires dynamic memory allocation support (heap), especially `malloc` and `realloc`.
+ * The parser state is kept in a `mml_parser_t`, so different tunes can be parsed concurrently.
  */
 
-/*! Manage parser errors */
-static void (*error_handler)(const char* err, int line, int column);
-static int line = 1;
-static int pos = 1;
-
 #define ARTICULATION_STACCATO (2.5 / 4.0)
 #define ARTICULATION_NORMAL (7.0 / 8.0)
 #define ARTICULATION_LEGATO (1.0)
 
-/*! Temporary list of sequencer stream frames, per channel */
-static struct seq_frame_map_t frame_map;
+struct mml_channel_state_t;
+
+/*! Parser state */
+struct mml_parser_t {
+	/*! Manage parser errors */
+	mml_error_handler_t error_handler;
+	void* user;
+	/*! Parser stats output, silent if NULL */
+	FILE* log;
+	int line;
+	int pos;
+	/*! Temporary list of sequencer stream frames, per channel */
+	struct seq_frame_map_t frame_map;
+	struct mml_channel_state_t* channel_states;
+	int channel_count;
+};
 
-static void init_stream_channel(int channel) {
+static void mml_error(struct mml_parser_t* parser, const char* err) {
+	if (parser->error_handler) {
+		parser->error_handler(err, parser->line, parser->pos, parser->user);
+	}
+}
+
+static void init_stream_channel(struct mml_parser_t* parser, int channel) {
 	// Init new channels
-	frame_map.channels[channel].count = 0;
-	frame_map.channels[channel].frames = malloc(sizeof(struct seq_frame_t) * 16);
+	parser->frame_map.channels[channel].count = 0;
+	parser->frame_map.channels[channel].frames = malloc(sizeof(struct seq_frame_t) * 16);
 }
 
-static int add_channel_frame(int channel, int frequency, int time_scale, int volume, double articulation, int edit_last_duration) {
+static int add_channel_frame(struct mml_parser_t* parser, int channel, int frequency, int time_scale, int volume, int wf_type, int adsr_shape, double articulation, int edit_last_duration) {
 	// New channel?
-	if (channel >= frame_map.channel_count) {
-		int old_count = frame_map.channel_count;
-		frame_map.channel_count = channel + 1;
-		frame_map.channels = realloc(frame_map.channels, sizeof(struct seq_frame_list_t) * frame_map.channel_count);
-		for (int i = old_count; i < frame_map.channel_count; i++) {
+	if (channel >= parser->frame_map.channel_count) {
+		int old_count = parser->frame_map.channel_count;
+		parser->frame_map.channel_count = channel + 1;
+		parser->frame_map.channels = realloc(parser->frame_map.channels, sizeof(struct seq_frame_list_t) * parser->frame_map.channel_count);
+		for (int i = old_count; i < parser->frame_map.channel_count; i++) {
 			// Init new channels
-			init_stream_channel(i);
+			init_stream_channel(parser, i);
 		}
 	}
 
-	struct seq_frame_list_t* list = &frame_map.channels[channel];
+	struct seq_frame_list_t* list = &parser->frame_map.channels[channel];
 	if (!edit_last_duration && list->count > 0 && (list->count % 16) == 0) {
 		list->frames = realloc(list->frames, sizeof(struct seq_frame_t) * (list->count + 16));
 	}
 
 	if (edit_last_duration && list->count == 0) {
-		error_handler("Can't join, no note before", line, pos);
+		mml_error(parser, "Can't join, no note before");
 		return 0;
 	}
 
@@ -76,33 +92,43 @@ static int add_channel_frame(int channel, int frequency, int time_scale, int vol
 
     if (!frequency) {
 		if (!voice_wf_setup_def(frame, 0, 0)) {
-			error_handler("Can't pack frame: pause", line, pos);
+			mml_error(parser, "Can't pack frame: pause");
 			return 0;
 		}
     } else {
 		if (!voice_wf_setup_def(frame, frequency, volume)) {
-			error_handler("Can't pack frame: waveform", line, pos);
+			mml_error(parser, "Can't pack frame: waveform");
 			return 0;
 		}
     }
+#ifdef WAVEFORM_TYPES
+	// Pauses are all the same, whatever the generator
+	frame->wf_type = frequency ? wf_type : WF_SQUARE;
+#ifdef WAVEFORM_RAMPS
+	// The ramps swing the amplitude in 8.8 fixed point: the full volume (stored as -128) is clamped to 127
+	if ((frame->wf_type == WF_SAWTOOTH || frame->wf_type == WF_TRIANGLE) && frame->wf_amplitude == INT8_MIN) {
+		frame->wf_amplitude = INT8_MAX;
+	}
+#endif
+#endif
 
 	// Calc duration and scale
 	if (edit_last_duration) {
 		time_scale += (frame->adsr_time_scale_1 + 1);
 	}
 	if (time_scale > UINT16_MAX) {
-		error_handler("Can't pack frame: adsr time_scale", line, pos);
+		mml_error(parser, "Can't pack frame: adsr time_scale");
 		return 0;
 	}
 	frame->adsr_time_scale_1 = time_scale - 1;
 	frame->adsr_release_start = (uint8_t)round(ADSR_TIME_UNITS * articulation) - 1;
+#ifdef ADSR_TABLE
+	// The envelope shape, in the upper bits: pauses all use the default one
+	frame->adsr_release_start |= (frequency ? adsr_shape : ADSR_SHAPE_DEFAULT) << ADSR_SHAPE_SHIFT;
+#endif
 	return 1;
 }
 
-void mml_set_error_handler(void (*handler)(const char* err, int line, int column)) {
-	error_handler = handler;
-}
-
 /*! Read a single digit from the stream and advance */
 static int read_digit(const char** str, int* pos) {
 	const char code = **str;
@@ -152,6 +178,10 @@ struct mml_channel_state_t {
 	int default_length_dot;
 	int tempo;
 	int volume;
+	/*! Waveform generator, WF_* */
+	int wf_type;
+	/*! Envelope shape, ADSR_SHAPE_* */
+	int adsr_shape;
 	double articulation;
 	// Active in current MML parsing line
 	int isActive;
@@ -161,8 +191,6 @@ struct mml_channel_state_t {
 		int time_units;
 	} running_time;
 };
-static struct mml_channel_state_t* mml_channel_states;
-static int mml_channel_count;
 
 /*! 
  * Get duration in ADSR time scale units. 
@@ -186,48 +214,51 @@ static int get_adsr_time_scale(struct mml_channel_state_t* state, int length, in
 	return time_scale;
 }
 
-static void enable_channel(int channel) {
-	if (channel >= mml_channel_count) {
-		mml_channel_count = channel + 1;
-		mml_channel_states = realloc(mml_channel_states, sizeof(struct mml_channel_state_t) * mml_channel_count);
+static void enable_channel(struct mml_parser_t* parser, int channel) {
+	if (channel >= parser->channel_count) {
+		parser->channel_count = channel + 1;
+		parser->channel_states = realloc(parser->channel_states, sizeof(struct mml_channel_state_t) * parser->channel_count);
 		// Init new channel
-		mml_channel_states[channel].octave = 4;
-		mml_channel_states[channel].default_length = 4;
-		mml_channel_states[channel].default_length_dot = 0;
-		mml_channel_states[channel].tempo = 120;
-		mml_channel_states[channel].volume = 63;
-		mml_channel_states[channel].articulation = ARTICULATION_NORMAL;
-		mml_channel_states[channel].running_time.seconds = 0;
-		mml_channel_states[channel].running_time.time_units = 0;
+		parser->channel_states[channel].octave = 4;
+		parser->channel_states[channel].default_length = 4;
+		parser->channel_states[channel].default_length_dot = 0;
+		parser->channel_states[channel].tempo = 120;
+		parser->channel_states[channel].volume = 63;
+		parser->channel_states[channel].wf_type = WF_SQUARE;
+		parser->channel_states[channel].adsr_shape = ADSR_SHAPE_DEFAULT;
+		parser->channel_states[channel].articulation = ARTICULATION_NORMAL;
+		parser->channel_states[channel].running_time.seconds = 0;
+		parser->channel_states[channel].running_time.time_units = 0;
 	}
 
-	mml_channel_states[channel].isActive = 1;
+	parser->channel_states[channel].isActive = 1;
 }
 
 // By default, if no channel identifier at the beginning of a MML line, it is referring to A channel only
-static void reset_active_state() {
-	for (int i = 1; i < mml_channel_count; i++) {
-		mml_channel_states[i].isActive = 0;
+static void reset_active_state(struct mml_parser_t* parser) {
+	for (int i = 1; i < parser->channel_count; i++) {
+		parser->channel_states[i].isActive = 0;
 	}
-	enable_channel(0);
+	enable_channel(parser, 0);
 }
 
 /*! 
  * Parse the MML file and produce sequencer stream of frames in `stream_channel` array.
  */
-static int mml_parse(const char* content) {
-	line = 1;
-	pos = 0;
+static int mml_parse(struct mml_parser_t* parser, const char* content) {
+	parser->line = 1;
+	parser->pos = 0;
 
 	// Starts with 1 voice
-	mml_channel_states = malloc(0);
-	frame_map.channels = malloc(0);
-	frame_map.channel_count = 0;
+	parser->channel_states = malloc(0);
+	parser->channel_count = 0;
+	parser->frame_map.channels = malloc(0);
+	parser->frame_map.channel_count = 0;
 
 	// Read the string until end
-	reset_active_state();
+	reset_active_state(parser);
 	while(1) {
-		pos++;
+		parser->pos++;
 		char code = content[0];
 		content++;
 		if (!code) {
@@ -237,12 +268,12 @@ static int mml_parse(const char* content) {
 		if (code <= 32 || code == '|') {
 			// Skip blanks and partitures
 			if (code == '\n') {
-				line++;
-				reset_active_state();
-				pos = 0;
+				parser->line++;
+				reset_active_state(parser);
+				parser->pos = 0;
 			}
 			if (code == '\r') {
-				pos--;
+				parser->pos--;
 			}
 			continue;
 		}
@@ -253,9 +284,9 @@ static int mml_parse(const char* content) {
 				content++;
 			}
 			content++;
-			line++;
-			reset_active_state();
-			pos = 0;
+			parser->line++;
+			reset_active_state(parser);
+			parser->pos = 0;
 			continue;
 		}
 
@@ -267,92 +298,92 @@ static int mml_parse(const char* content) {
 		}
 
 		if (code >= 'A' && code <= 'Z') {
-			if (pos == 1) {
+			if (parser->pos == 1) {
 				// Decode active channels
-				mml_channel_states[0].isActive = 0;
-				enable_channel(code - 'A');
+				parser->channel_states[0].isActive = 0;
+				enable_channel(parser, code - 'A');
 				while (*content >= 'A' && *content <= 'Z') {
-					enable_channel(*content - 'A');
+					enable_channel(parser, *content - 'A');
 					content++;
-					pos++;
+					parser->pos++;
 				}
 				continue;
 			} else {
-				error_handler("Misplaced channel selector", line, pos);
+				mml_error(parser, "Misplaced channel selector");
 			}
 		}
 
 		int isPause;
-		int isNoteCode;
+		int isNoteCode = 0;
 		if (code == 'o') {
-			int octave = read_digit(&content, &pos);
+			int octave = read_digit(&content, &parser->pos);
 			if (octave == 255 || octave > 6) {
-				error_handler("Invalid octave", line, pos);
+				mml_error(parser, "Invalid octave");
 				return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].octave = octave;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].octave = octave;
 				}
 			}
 		} else if (code == 'l') {
-			int length = read_number(&content, &pos);
+			int length = read_number(&content, &parser->pos);
 			if (length < 0) {
-				error_handler("Invalid length", line, pos);
+				mml_error(parser, "Invalid length");
 				return 1;
 			}
 			int dot = 0;
 			while (*content == '.') {
 				dot++;
 				content++;
-				pos++;
+				parser->pos++;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].default_length = length;
-					mml_channel_states[i].default_length_dot = dot;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].default_length = length;
+					parser->channel_states[i].default_length_dot = dot;
 				}
 			}
 		} else if (code == 't') {
-			int tempo = read_number(&content, &pos);
+			int tempo = read_number(&content, &parser->pos);
 			if (tempo < 0) {
-				error_handler("Invalid tempo", line, pos);
+				mml_error(parser, "Invalid tempo");
 				return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].tempo = tempo;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].tempo = tempo;
 				}
 			}
 		} else if (code == 'v') {
-			int volume = read_number(&content, &pos);
+			int volume = read_number(&content, &parser->pos);
 			if (volume < 0 || volume > 128) {
-				error_handler("Invalid volume", line, pos);
+				mml_error(parser, "Invalid volume");
 				return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].volume = volume;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].volume = volume;
 				}
 			}
 		} else if (code == '<') {
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					if (mml_channel_states[i].octave == 0) {
-						error_handler("Invalid octave step down", line, pos);
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					if (parser->channel_states[i].octave == 0) {
+						mml_error(parser, "Invalid octave step down");
 						return 1;
 					}
-					mml_channel_states[i].octave--;
+					parser->channel_states[i].octave--;
 				}
 			}
 		} else if (code == '>') {
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					if (mml_channel_states[i].octave == 9) {
-						error_handler("Invalid octave step up", line, pos);
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					if (parser->channel_states[i].octave == 9) {
+						mml_error(parser, "Invalid octave step up");
 						return 1;
 					}
-					mml_channel_states[i].octave++;
+					parser->channel_states[i].octave++;
 				}
 			}
 		} else if (code == 'm') {
@@ -369,16 +400,65 @@ static int mml_parse(const char* content) {
 					articulation = ARTICULATION_STACCATO;
 					break;
 				default:
-					error_handler("Invalid music articulation", line, pos);
+					mml_error(parser, "Invalid music articulation");
+					return 1;
+			}
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].articulation = articulation;
+				}
+			}
+			parser->pos++;
+			content++;
+		} else if (code == 'w') {
+			// Waveform: only the generators compiled in the synth are available
+			int wf_type;
+			switch (*content) {
+				case 's':
+					wf_type = WF_SQUARE;
+					break;
+#ifdef WAVEFORM_SAWTOOTH
+				case 'w':
+					wf_type = WF_SAWTOOTH;
+					break;
+#endif
+#ifdef WAVEFORM_TRIANGLE
+				case 't':
+					wf_type = WF_TRIANGLE;
+					break;
+#endif
+#ifdef WAVEFORM_NOISE
+				case 'n':
+					wf_type = WF_NOISE;
+					break;
+#endif
+				default:
+					mml_error(parser, "Invalid or unsupported waveform");
 					return 1;
 			}
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
-					mml_channel_states[i].articulation = articulation;
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].wf_type = wf_type;
 				}
 			}
-			pos++;
+			parser->pos++;
 			content++;
+		} else if (code == '@') {
+			// Envelope shape: only the default one without the envelope tables
+			int adsr_shape = read_digit(&content, &parser->pos);
+#ifdef ADSR_TABLE
+			if (adsr_shape < 0 || adsr_shape >= ADSR_SHAPE_COUNT) {
+#else
+			if (adsr_shape != ADSR_SHAPE_DEFAULT) {
+#endif
+				mml_error(parser, "Invalid or unsupported envelope shape");
+				return 1;
+			}
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
+					parser->channel_states[i].adsr_shape = adsr_shape;
+				}
+			}
 		} else if ((isPause = (code == 'p' || code == 'r')) || (isNoteCode = code == 'n') || (code >= 'a' && code <= 'g')) {
 			// Note or pause
 			int length = -1;
@@ -397,35 +477,35 @@ static int mml_parse(const char* content) {
 							code--;
 						}
 						if (code == 'e' || code == 'b') {
-							error_handler("Invalid sharp", line, pos);
+							mml_error(parser, "Invalid sharp");
 							return 1;
 						}
 						sharp = 1;
 						content++;
-						pos++;
+						parser->pos++;
 						continue;
 					}
 				}
 				if (next >= '0' && next <= '9') {
 					if (isNoteCode) {
 						if (noteCode != -1) {
-							error_handler("Invalid note code", line, pos);
+							mml_error(parser, "Invalid note code");
 							return 1;
 						}
-						noteCode = read_number(&content, &pos);
+						noteCode = read_number(&content, &parser->pos);
 						if (noteCode < 0 || noteCode > 84) {
-							error_handler("Invalid note code", line, pos);
+							mml_error(parser, "Invalid note code");
 							return 1;
 						}
 					} else {
 						if (customLength) {
-							error_handler("Invalid length", line, pos);
+							mml_error(parser, "Invalid length");
 							return 1;
 						}
 						// Length
-						length = read_number(&content, &pos);
+						length = read_number(&content, &parser->pos);
 						if (length < 0) {
-							error_handler("Invalid length", line, pos);
+							mml_error(parser, "Invalid length");
 							return 1;
 						}
 						customLength = 1;
@@ -436,49 +516,58 @@ static int mml_parse(const char* content) {
 					// Half length
 					dot++;
 					content++;
-					pos++;
+					parser->pos++;
 					continue;
 				}
 				break;
 			}
 
 			// Set note
-			for (int i = 0; i < mml_channel_count; i++) {
-				if (mml_channel_states[i].isActive) {
+			for (int i = 0; i < parser->channel_count; i++) {
+				if (parser->channel_states[i].isActive) {
 					if (isNoteCode && noteCode == 0) {
 						isPause = 1;
 					}
-					int frequency = isPause ? 0 : (isNoteCode ? get_freq_from_code(noteCode) : get_freq_from_note(code, sharp, mml_channel_states[i].octave));
-					int time_scale = get_adsr_time_scale(&mml_channel_states[i], length < 0 ? mml_channel_states[i].default_length : length, (length < 0 && !dot) ? mml_channel_states[i].default_length_dot : dot);
+					int frequency = isPause ? 0 : (isNoteCode ? get_freq_from_code(noteCode) : get_freq_from_note(code, sharp, parser->channel_states[i].octave));
+					int time_scale = get_adsr_time_scale(&parser->channel_states[i], length < 0 ? parser->channel_states[i].default_length : length, (length < 0 && !dot) ? parser->channel_states[i].default_length_dot : dot);
 					
-					if (!add_channel_frame(i, frequency, time_scale, mml_channel_states[i].volume, mml_channel_states[i].articulation, join)) {
+					if (!add_channel_frame(parser, i, frequency, time_scale, parser->channel_states[i].volume, parser->channel_states[i].wf_type, parser->channel_states[i].adsr_shape, parser->channel_states[i].articulation, join)) {
 						return 1;
 					}
 				}
 			}
 		} else {
-			error_handler("Unknown command", line, pos);
+			mml_error(parser, "Unknown command");
 			return 1;
 		}
 	}
 
-	printf("MML stats:\n");
-	for (int i = 0; i < mml_channel_count; i++) {
-		printf("\tchannel %d time %fs (%d samples)\n", i, (float)mml_channel_states[i].running_time.seconds, mml_channel_states[i].running_time.time_units);
+	if (parser->log) {
+		fprintf(parser->log, "MML stats:\n");
+		for (int i = 0; i < parser->channel_count; i++) {
+			fprintf(parser->log, "\tchannel %d time %fs (%d samples)\n", i, (float)parser->channel_states[i].running_time.seconds, parser->channel_states[i].running_time.time_units);
+		}
 	}
-
-	free(mml_channel_states);
+	return 0;
 }
 
 /*! 
  * Parse the MML file and produce sequencer frames map.
  */
-int mml_compile(const char* content, struct seq_frame_map_t* map) {
-	int ret = mml_parse(content);
+int mml_compile(const char* content, struct seq_frame_map_t* map, mml_error_handler_t error_handler, void* user, FILE* log) {
+	struct mml_parser_t parser;
+	memset(&parser, 0, sizeof(struct mml_parser_t));
+	parser.error_handler = error_handler;
+	parser.user = user;
+	parser.log = log;
+
+	int ret = mml_parse(&parser, content);
+	free(parser.channel_states);
 	if (ret) {
+		mml_free(&parser.frame_map);
 		return ret;
 	}
-	*map = frame_map;
+	*map = parser.frame_map;
 	return 0;
 }
 
@@ -24,17 +24,19 @@
 #include "synth.h"
 #include "sequencer.h"
 
-/*! Manage parser errors, used to display it in pc ports */
-void mml_set_error_handler(void (*handler)(const char* err, int line, int column));
+/*! Manage parser errors, used to display it in pc ports. `user` is the pointer passed to `mml_compile` */
+typedef void (*mml_error_handler_t)(const char* err, int line, int column, void* user);
 
 /*! 
  * Parse the MML file (entirely read and passed to `content`) and produce 
  * an offline set of frames by channel (frame map).
  * The returned set can be transformed in a sequential stream
  * by `seq_compile`.
+ * Errors are reported to `error_handler` (if not NULL), the channel durations to `log` (if not NULL).
+ * The parser is reentrant: different tunes can be parsed concurrently.
  * Returns non-zero in case of parse error.
  */
-int mml_compile(const char* content, struct seq_frame_map_t* map);
+int mml_compile(const char* content, struct seq_frame_map_t* map, mml_error_handler_t error_handler, void* user, FILE* log);
 
 /*!
  * Free the map allocated by `mml_compile`.
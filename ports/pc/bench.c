@@ -0,0 +1,363 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, benchmarks of the hot paths.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "synth.h"
+#include "sequencer.h"
+#include "mml.h"
+#include "player.h"
+#include "resample.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*! Allocations, counted by the linker wrappers of the allocator (`-Wl,--wrap=malloc` etc...) */
+static uint64_t alloc_count;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+	alloc_count++;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+	alloc_count++;
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+	alloc_count++;
+	return __real_realloc(ptr, size);
+}
+
+/*! Minimum duration of a benchmark, in seconds */
+static double min_time = 0.2;
+
+/*! A benchmark: runs the code once, and returns the count of processed units */
+typedef uint64_t (*bench_run_t)(void* arg);
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*! Repeat `run` for at least `min_time` seconds, and report a JSON line */
+static void bench(const char* name, const char* tune, const char* unit, bench_run_t run, void* arg) {
+	uint64_t ops = 0;
+	uint64_t runs = 0;
+	uint64_t allocs = alloc_count;
+	double start = now();
+	double elapsed;
+	do {
+		ops += run(arg);
+		runs++;
+		elapsed = now() - start;
+	} while (elapsed < min_time);
+	allocs = alloc_count - allocs;
+
+	printf("{\"bench\": \"%s\", \"tune\": ", name);
+	printf(tune ? "\"%s\"" : "null", tune);
+	printf(", \"voice_count\": %d, \"synth_freq\": %d, \"unit\": \"%s\", \"runs\": %llu, \"ops\": %llu, \"ns_per_op\": %.3f, \"ops_per_sec\": %.0f, \"allocs_per_run\": %.1f}\n",
+		VOICE_COUNT, (int)synth_freq, unit, (unsigned long long)runs, (unsigned long long)ops,
+		elapsed * 1e9 / ops, ops / elapsed, (double)allocs / runs);
+	fflush(stdout);
+}
+
+/*! The generators, running a single voice on a private context */
+struct generator_bench_t {
+	struct seq_ctx_t ctx;
+	struct seq_frame_t frame;
+	/*! Sink of the samples, to keep the calls */
+	volatile int8_t sink;
+};
+
+#define GENERATOR_CALLS 0x10000
+
+static void generator_init(struct generator_bench_t* gen) {
+	seq_ctx_init(&gen->ctx, NULL, NULL);
+	gen->ctx.seq_voice_count = 1;
+	gen->ctx.cur_voice = &gen->ctx.synth.voice[0];
+	gen->frame.adsr_time_scale_1 = 20;
+	gen->frame.adsr_release_start = 40;
+	voice_wf_setup_def(&gen->frame, 440, 64);
+	struct seq_ctx_t* ctx = &gen->ctx;
+	voice_wf_set(ctx, &gen->frame);
+	adsr_config(ctx, &gen->frame);
+}
+
+/*! Restart the envelope at its end, as the sequencer does */
+static void generator_restart(struct generator_bench_t* gen) {
+	struct seq_ctx_t* ctx = &gen->ctx;
+	if (ctx->cur_voice->adsr.state_counter == ADSR_STATE_END) {
+		adsr_config(ctx, &gen->frame);
+	}
+}
+
+static uint64_t bench_adsr_next(void* arg) {
+	struct generator_bench_t* gen = arg;
+	struct seq_ctx_t* ctx = &gen->ctx;
+	for (int i = 0; i < GENERATOR_CALLS; i++) {
+		adsr_next(ctx);
+		generator_restart(gen);
+	}
+	return GENERATOR_CALLS;
+}
+
+static uint64_t bench_voice_wf_next(void* arg) {
+	struct generator_bench_t* gen = arg;
+	struct seq_ctx_t* ctx = &gen->ctx;
+	for (int i = 0; i < GENERATOR_CALLS; i++) {
+		gen->sink = voice_wf_next(ctx);
+	}
+	return GENERATOR_CALLS;
+}
+
+static uint64_t bench_voice_ch_next(void* arg) {
+	struct generator_bench_t* gen = arg;
+	struct seq_ctx_t* ctx = &gen->ctx;
+	for (int i = 0; i < GENERATOR_CALLS; i++) {
+		gen->sink = voice_ch_next(ctx);
+		generator_restart(gen);
+	}
+	return GENERATOR_CALLS;
+}
+
+/*! The output resampler, over a block of synth samples */
+struct resampler_bench_t {
+	struct resampler_t resampler;
+	int8_t input[GENERATOR_CALLS];
+	int16_t output[GENERATOR_CALLS];
+};
+
+static uint64_t bench_resampler_run(void* arg) {
+	struct resampler_bench_t* res = arg;
+	uint64_t count = 0;
+	size_t block = resampler_max_input(&res->resampler, GENERATOR_CALLS);
+	for (size_t i = 0; i < GENERATOR_CALLS; i += block) {
+		count += resampler_run(&res->resampler, res->input + i, i + block > GENERATOR_CALLS ? GENERATOR_CALLS - i : block, res->output);
+	}
+	return count;
+}
+
+/*! A tune, at the different compilation steps */
+struct tune_bench_t {
+	const char* content;
+	struct seq_frame_map_t map;
+	struct seq_frame_t* frames;
+	int frame_count;
+	int voice_count;
+	int options;
+	struct bit_stream_t stream;
+};
+
+static void mml_error(const char* err, int line, int column, void* user) {
+	fprintf(stderr, "Error reading MML file %s: %s at line %d, pos %d\n", (const char*)user, err, line, column);
+}
+
+static uint64_t bench_mml_compile(void* arg) {
+	struct tune_bench_t* tune = arg;
+	struct seq_frame_map_t map;
+	mml_compile(tune->content, &map, NULL, NULL, NULL);
+	mml_free(&map);
+	return tune->frame_count;
+}
+
+static uint64_t bench_seq_compile(void* arg) {
+	struct tune_bench_t* tune = arg;
+	struct seq_frame_t* frames;
+	int frame_count, voice_count, do_clip_check;
+	seq_compile(&tune->map, 0, NULL, NULL, NULL, &frames, &frame_count, &voice_count, &do_clip_check);
+	seq_free(frames);
+	return frame_count;
+}
+
+static uint64_t bench_stream_compress(void* arg) {
+	struct tune_bench_t* tune = arg;
+	struct bit_stream_t stream;
+	stream_compress(tune->frames, tune->frame_count, tune->options, NULL, &stream);
+	stream_free(&stream);
+	return tune->frame_count;
+}
+
+static uint64_t bench_stream_read_frame(void* arg) {
+	struct tune_bench_t* tune = arg;
+	struct stream_reader_t reader;
+	struct seq_frame_t frame;
+	uint64_t count = 0;
+	stream_reader_init(&reader, &tune->stream);
+	do {
+		stream_read_frame(&reader, &frame);
+		count++;
+	} while (frame.adsr_time_scale_1 && count <= (uint64_t)tune->frame_count);
+	return count;
+}
+
+static int8_t block[SEQ_BLOCK_SIZE];
+
+/*! Play the whole tune through the frame ring, sample by sample or by blocks */
+static uint64_t tune_play(struct tune_bench_t* tune, int by_blocks) {
+	struct stream_reader_t reader;
+	static struct frame_ring_t ring;
+	struct seq_ctx_t ctx;
+	uint64_t count = 0;
+	stream_reader_init(&reader, &tune->stream);
+	frame_ring_init(&ring, &reader);
+	frame_ring_fill(&ring);
+	seq_ctx_init(&ctx, frame_ring_require, &ring);
+	seq_play_stream(&ctx, tune->voice_count);
+	while (!ctx.seq_end) {
+		frame_ring_fill(&ring);
+		if (by_blocks) {
+			count += seq_render_block(&ctx, block, SEQ_BLOCK_SIZE);
+		} else {
+			for (int i = 0; i < SEQ_BLOCK_SIZE && !ctx.seq_end; i++, count++) {
+				block[i] = seq_feed_synth(&ctx);
+			}
+		}
+	}
+	return count;
+}
+
+static uint64_t bench_seq_feed_synth(void* arg) {
+	return tune_play(arg, 0);
+}
+
+static uint64_t bench_seq_render_block(void* arg) {
+	return tune_play(arg, 1);
+}
+
+static char* read_file(const char* name) {
+	FILE *fp = fopen(name, "r");
+	if (!fp) {
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	char* content = malloc(size + 1);
+	fseek(fp, 0, SEEK_SET);
+	fread(content, 1, size, fp);
+	content[size] = 0;
+	fclose(fp);
+	return content;
+}
+
+/*! Run all the benchmarks of a tune */
+static int bench_tune(const char* path) {
+	const char* name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	struct tune_bench_t tune;
+	memset(&tune, 0, sizeof(struct tune_bench_t));
+	char* content = read_file(path);
+	if (!content) {
+		fprintf(stderr, "Error reading MML file: %s\n", path);
+		return 1;
+	}
+	tune.content = content;
+	if (mml_compile(content, &tune.map, mml_error, (void*)path, NULL)) {
+		free(content);
+		return 1;
+	}
+	int do_clip_check;
+	seq_compile(&tune.map, 0, NULL, NULL, NULL, &tune.frames, &tune.frame_count, &tune.voice_count, &do_clip_check);
+
+	bench("mml_compile", name, "frame", bench_mml_compile, &tune);
+	bench("seq_compile", name, "frame", bench_seq_compile, &tune);
+
+	// Fixed-size refs, and the smallest stream
+	static const struct { const char* suffix; int options; } modes[] = {
+		{ "", 0 },
+		{ "/huffman+backref", STREAM_HUFFMAN | STREAM_BACKREF },
+	};
+	for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		char bench_name[64];
+		tune.options = modes[i].options;
+		snprintf(bench_name, sizeof(bench_name), "stream_compress%s", modes[i].suffix);
+		bench(bench_name, name, "frame", bench_stream_compress, &tune);
+
+		stream_compress(tune.frames, tune.frame_count, tune.options, NULL, &tune.stream);
+		snprintf(bench_name, sizeof(bench_name), "stream_read_frame%s", modes[i].suffix);
+		bench(bench_name, name, "frame", bench_stream_read_frame, &tune);
+		if (tune.voice_count <= VOICE_COUNT) {
+			snprintf(bench_name, sizeof(bench_name), "seq_feed_synth%s", modes[i].suffix);
+			bench(bench_name, name, "sample", bench_seq_feed_synth, &tune);
+			snprintf(bench_name, sizeof(bench_name), "seq_render_block%s", modes[i].suffix);
+			bench(bench_name, name, "sample", bench_seq_render_block, &tune);
+		} else {
+			fprintf(stderr, "%s: %d voices, more than the synth ones: playback skipped\n", name, tune.voice_count);
+		}
+		stream_free(&tune.stream);
+	}
+
+	seq_free(tune.frames);
+	mml_free(&tune.map);
+	free(content);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc > 2 && !strcmp(argv[1], "-t")) {
+		min_time = atof(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "Usage: bench [-t SECONDS] FILE.mml...\n");
+		fprintf(stderr, "\tRuns the benchmarks of the hot paths, printing a JSON line per result\n");
+		fprintf(stderr, "\t-t SECONDS\tminimum duration of a benchmark (default 0.2)\n");
+		return 1;
+	}
+
+	adsr_gains_init();
+
+	struct generator_bench_t gen;
+	generator_init(&gen);
+	bench("adsr_next", NULL, "call", bench_adsr_next, &gen);
+	generator_init(&gen);
+	bench("voice_wf_next", NULL, "call", bench_voice_wf_next, &gen);
+	generator_init(&gen);
+	bench("voice_ch_next", NULL, "call", bench_voice_ch_next, &gen);
+
+	// Output samples of the resampler, at the usual rates of the devices
+	static struct resampler_bench_t res;
+	for (int i = 0; i < GENERATOR_CALLS; i++) {
+		generator_restart(&gen);
+		res.input[i] = voice_ch_next(&gen.ctx);
+	}
+	static const uint32_t rates[] = { 44100, 48000 };
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		char bench_name[64];
+		if (resampler_init(&res.resampler, synth_freq, rates[i])) {
+			continue;
+		}
+		snprintf(bench_name, sizeof(bench_name), "resampler_run/%d", (int)rates[i]);
+		bench(bench_name, NULL, "sample", bench_resampler_run, &res);
+		resampler_free(&res.resampler);
+	}
+
+	int errors = 0;
+	for (int i = 1; i < argc; i++) {
+		errors += bench_tune(argv[i]);
+	}
+	return errors > 0;
+}
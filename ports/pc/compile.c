@@ -0,0 +1,634 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, MML tune compiler.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "compile.h"
+#include "mml.h"
+#include "codegen.h"
+#include "player.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+static void mml_error(const char* err, int line, int column, void* user) {
+	fprintf(stderr, "Error reading MML file %s: %s at line %d, pos %d\n", (const char*)user, err, line, column);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/*! FNV-1a hash of `data`, continuing `hash` */
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* ptr = data;
+	for (; size; size--) {
+		hash = (hash ^ *(ptr++)) * FNV_PRIME;
+	}
+	return hash;
+}
+
+/*! An encoding evaluated by the autotuner */
+struct autotune_candidate_t {
+	int options;
+	int error;
+	struct bit_stream_t stream;
+	struct stream_cost_t cost;
+};
+
+/*! The candidate queue, shared by the worker threads */
+struct autotune_t {
+	struct seq_frame_t* frame_stream;
+	int frame_count;
+	int voice_count;
+	const struct stream_cost_model_t* model;
+	struct autotune_candidate_t candidates[AUTOTUNE_MAX_CANDIDATES];
+	int count;
+	int next;
+};
+
+static void* autotune_worker(void* arg) {
+	struct autotune_t* tune = arg;
+	while (1) {
+		int i = __atomic_fetch_add(&tune->next, 1, __ATOMIC_RELAXED);
+		if (i >= tune->count) {
+			return NULL;
+		}
+		struct autotune_candidate_t* candidate = &tune->candidates[i];
+		candidate->error = stream_pack(tune->frame_stream, tune->frame_count, candidate->options, NULL, &candidate->stream);
+		if (!candidate->error) {
+			stream_cost(&candidate->stream, tune->frame_count, tune->voice_count, tune->model, &candidate->cost);
+		}
+	}
+}
+
+static void autotune_add(struct autotune_t* tune, int options) {
+	struct autotune_candidate_t* candidate = &tune->candidates[tune->count++];
+	memset(candidate, 0, sizeof(struct autotune_candidate_t));
+	candidate->options = options;
+}
+
+/*! Describe the encoding `options` in `name` */
+static void encoding_name(int options, char* name, size_t size) {
+	snprintf(name, size, "%s%s%s%s%s%s", (options & STREAM_TUPLES) ? "tuples" : "fields",
+		(options & STREAM_HUFFMAN) ? " huffman" : "", (options & STREAM_BACKREF) ? " backref" : "",
+		(options & STREAM_ALIGN_NIBBLE) ? " nibble" : "", (options & STREAM_ALIGN_BYTE) ? " byte" : "",
+		(options & SEQ_CODEGEN_UNROLL) ? " unroll" : "");
+}
+
+/*! The candidate `a` decodes faster than `b`: by the worst frame, then the average, then the smaller */
+static int autotune_better(const struct autotune_candidate_t* a, const struct autotune_candidate_t* b) {
+	if (a->cost.worst_cycles != b->cost.worst_cycles) {
+		return a->cost.worst_cycles < b->cost.worst_cycles;
+	}
+	if (a->cost.cycles != b->cost.cycles) {
+		return a->cost.cycles < b->cost.cycles;
+	}
+	return a->cost.words < b->cost.words;
+}
+
+/*!
+ * Compress the frame stream with every encoding of the compiler, evaluated by `jobs` threads, and keep in `stream`
+ * the fastest decoding one that fits in the `budget`. The stream options of `options` are replaced, the others kept.
+ * The candidates are reported to `log` (if not NULL). Returns non-zero if no encoding fits.
+ */
+static int autotune(struct seq_frame_t* frame_stream, int frame_count, int voice_count, int options, const struct autotune_budget_t* budget, int jobs, FILE* log, struct bit_stream_t* stream) {
+	static const struct stream_cost_model_t model = STREAM_COST_MODEL_PIC12F683;
+	struct autotune_t* tune = malloc(sizeof(struct autotune_t));
+	tune->frame_stream = frame_stream;
+	tune->frame_count = frame_count;
+	tune->voice_count = voice_count;
+	tune->model = &model;
+	tune->count = 0;
+	tune->next = 0;
+
+	int base = options & ~(STREAM_HUFFMAN | STREAM_BACKREF | STREAM_TUPLES | STREAM_FIELDS | STREAM_ALIGN_NIBBLE | STREAM_ALIGN_BYTE | SEQ_CODEGEN_UNROLL);
+	const int layouts[] = { STREAM_FIELDS, STREAM_TUPLES };
+	const int aligns[] = { 0, STREAM_ALIGN_NIBBLE, STREAM_ALIGN_BYTE };
+	for (int layout = 0; layout < 2; layout++) {
+		for (int coding = 0; coding <= (STREAM_HUFFMAN | STREAM_BACKREF); coding++) {
+			// Huffman codes are not aligned, and only the fixed-width streams have the phase-unrolled decoder
+			for (int align = 0; align < ((coding & STREAM_HUFFMAN) ? 1 : 3); align++) {
+				int encoding = base | layouts[layout] | coding | aligns[align];
+				autotune_add(tune, encoding);
+				if (!coding) {
+					autotune_add(tune, encoding | SEQ_CODEGEN_UNROLL);
+				}
+			}
+		}
+	}
+
+	if (jobs <= 0) {
+		jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (jobs > tune->count) {
+		jobs = tune->count;
+	}
+	if (jobs == 1) {
+		autotune_worker(tune);
+	} else {
+		pthread_t threads[AUTOTUNE_MAX_CANDIDATES];
+		for (int i = 0; i < jobs; i++) {
+			pthread_create(&threads[i], NULL, autotune_worker, tune);
+		}
+		for (int i = 0; i < jobs; i++) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	struct autotune_candidate_t* best = NULL;
+	for (int i = 0; i < tune->count; i++) {
+		struct autotune_candidate_t* candidate = &tune->candidates[i];
+		if (!candidate->error && candidate->cost.words <= budget->words && candidate->cost.worst_cycles <= budget->cycles &&
+			(!best || autotune_better(candidate, best))) {
+			best = candidate;
+		}
+	}
+
+	if (log) {
+		fprintf(log, "Autotune, %d words and %d cycles per frame:\n", budget->words, budget->cycles);
+		for (int i = 0; i < tune->count; i++) {
+			struct autotune_candidate_t* candidate = &tune->candidates[i];
+			char name[64];
+			encoding_name(candidate->options, name, sizeof(name));
+			if (candidate->error) {
+				fprintf(log, "\t  %-28s not encodable\n", name);
+			} else {
+				fprintf(log, "\t%c %-28s %6d words %8.1f avg cycles %6d worst cycles%s\n", candidate == best ? '*' : ' ', name,
+					candidate->cost.words, candidate->cost.cycles, candidate->cost.worst_cycles,
+					(candidate->cost.words > budget->words || candidate->cost.worst_cycles > budget->cycles) ? ", over budget" : "");
+			}
+		}
+	}
+
+	for (int i = 0; i < tune->count; i++) {
+		if (&tune->candidates[i] != best) {
+			stream_free(&tune->candidates[i].stream);
+		}
+	}
+	int err = 0;
+	if (best) {
+		*stream = best->stream;
+	} else {
+		fprintf(stderr, "No encoding fits in %d words and %d cycles per frame\n", budget->words, budget->cycles);
+		err = 1;
+	}
+	free(tune);
+	return err;
+}
+
+int compile_mml(const char* name, const char* out_name, int options, const struct seq_cost_model_t* cost, const struct seq_quantize_t* quantize, const struct autotune_budget_t* budget, int jobs, struct seq_stats_t* stats, FILE* log, struct compile_result_t* result) {
+	double start = now();
+	FILE *fp = fopen(name, "r");
+	if (!fp) {
+		fprintf(stderr, "Error reading MML file: %s\n", name);
+		return 1;
+	}
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	char* content = malloc(size + 1);
+	fseek(fp, 0, SEEK_SET);
+	fread(content, 1, size, fp);
+	content[size] = 0;
+	fclose(fp);
+
+	struct seq_frame_map_t map;
+	int err = mml_compile(content, &map, mml_error, (void*)name, log);
+	free(content);
+	if (err) {
+		return err;
+	}
+	if (quantize) {
+		seq_quantize(&map, quantize, log);
+	}
+
+	// Sort frames in stream
+	int do_clip_check;
+	struct seq_frame_t* seq_frame_stream;
+	seq_compile(&map, options, cost, stats, log, &seq_frame_stream, &result->frame_count, &result->voice_count, &do_clip_check);
+	mml_free(&map);
+
+	// Compress stream
+	if (budget) {
+		err = autotune(seq_frame_stream, result->frame_count, result->voice_count, options, budget, jobs, log, &result->stream);
+		if (!err && log) {
+			stream_print(&result->stream, result->frame_count, log);
+		}
+	} else {
+		err = stream_compress(seq_frame_stream, result->frame_count, options, log, &result->stream);
+	}
+	seq_free(seq_frame_stream);
+	if (err) {
+		return err;
+	}
+
+	// Empty channels are skipped by the compiler: the player needs the voice count
+	err = codegen_write(name, out_name, &result->stream, result->voice_count, do_clip_check, log);
+	result->compile_time = now() - start;
+	return err;
+}
+
+/*! Name of the tune in the golden and statistics files: the file name */
+static const char* tune_name(const char* path) {
+	const char* base = strrchr(path, '/');
+	return base ? base + 1 : path;
+}
+
+int stats_open(struct stats_file_t* stats_file, const char* name) {
+	size_t len = strlen(name);
+	stats_file->json = len >= 5 && !strcmp(name + len - 5, ".json");
+	stats_file->count = 0;
+	stats_file->file = fopen(name, "w");
+	if (!stats_file->file) {
+		fprintf(stderr, "Cannot open the statistics file %s\n", name);
+		return 1;
+	}
+	fprintf(stats_file->file, stats_file->json ? "[" : "tune,metric,index,value\n");
+	return 0;
+}
+
+/*! Peak and average of a histogram of voice counts */
+static void histogram_stats(const uint32_t* histogram, int voice_count, uint32_t sample_count, int* peak, double* average) {
+	uint64_t total = 0;
+	*peak = 0;
+	for (int i = 0; i <= voice_count; i++) {
+		total += (uint64_t)histogram[i] * i;
+		if (histogram[i]) {
+			*peak = i;
+		}
+	}
+	*average = sample_count ? (double)total / sample_count : 0;
+}
+
+static void stats_write_histogram(struct stats_file_t* stats_file, const char* tune, const char* metric, const uint32_t* histogram, int voice_count) {
+	FILE* file = stats_file->file;
+	if (stats_file->json) {
+		fprintf(file, ", \"%s\": [", metric);
+	}
+	for (int i = 0; i <= voice_count; i++) {
+		if (stats_file->json) {
+			fprintf(file, "%s%u", i ? ", " : "", histogram[i]);
+		} else {
+			fprintf(file, "%s,%s,%d,%u\n", tune, metric, i, histogram[i]);
+		}
+	}
+	if (stats_file->json) {
+		fprintf(file, "]");
+	}
+}
+
+void stats_write(struct stats_file_t* stats_file, const char* tune, const struct seq_stats_t* stats) {
+	FILE* file = stats_file->file;
+	int peak_busy, peak_audible;
+	double average_busy, average_audible;
+	tune = tune_name(tune);
+	histogram_stats(stats->busy_histogram, stats->voice_count, stats->sample_count, &peak_busy, &average_busy);
+	histogram_stats(stats->audible_histogram, stats->voice_count, stats->sample_count, &peak_audible, &average_audible);
+
+	if (stats_file->json) {
+		fprintf(file, "%s\n{\"tune\": \"%s\", \"samples\": %u, \"seconds\": %.3f, \"peak_busy\": %d, \"average_busy\": %.3f, \"peak_audible\": %d, \"average_audible\": %.3f, \"voices\": [",
+			stats_file->count ? "," : "", tune, stats->sample_count, (double)stats->sample_count / SYNTH_FREQ, peak_busy, average_busy, peak_audible, average_audible);
+	} else {
+		fprintf(file, "%s,samples,,%u\n", tune, stats->sample_count);
+		fprintf(file, "%s,peak_busy,,%d\n%s,average_busy,,%.3f\n", tune, peak_busy, tune, average_busy);
+		fprintf(file, "%s,peak_audible,,%d\n%s,average_audible,,%.3f\n", tune, peak_audible, tune, average_audible);
+	}
+	for (int i = 0; i < stats->voice_count; i++) {
+		const struct seq_voice_stats_t* voice = &stats->voices[i];
+		uint32_t idle = stats->sample_count - voice->busy;
+		if (stats_file->json) {
+			fprintf(file, "%s{\"busy\": %u, \"idle\": %u, \"muted\": %u, \"rest\": %u}", i ? ", " : "", voice->busy, idle, voice->muted, voice->rest);
+		} else {
+			fprintf(file, "%s,voice_busy,%d,%u\n%s,voice_idle,%d,%u\n", tune, i, voice->busy, tune, i, idle);
+			fprintf(file, "%s,voice_muted,%d,%u\n%s,voice_rest,%d,%u\n", tune, i, voice->muted, tune, i, voice->rest);
+		}
+	}
+	if (stats_file->json) {
+		fprintf(file, "]");
+	}
+	stats_write_histogram(stats_file, tune, "busy_histogram", stats->busy_histogram, stats->voice_count);
+	stats_write_histogram(stats_file, tune, "audible_histogram", stats->audible_histogram, stats->voice_count);
+
+	// Clipped runs: start sample and length
+	if (stats_file->json) {
+		fprintf(file, ", \"clips\": [");
+	}
+	for (int i = 0; i < stats->clip_run_count; i++) {
+		const struct seq_clip_run_t* run = &stats->clip_runs[i];
+		if (stats_file->json) {
+			fprintf(file, "%s{\"start\": %u, \"length\": %u}", i ? ", " : "", run->start, run->length);
+		} else {
+			fprintf(file, "%s,clip,%u,%u\n", tune, run->start, run->length);
+		}
+	}
+	if (stats_file->json) {
+		fprintf(file, "]}");
+	}
+	stats_file->count++;
+}
+
+void stats_close(struct stats_file_t* stats_file) {
+	if (stats_file->json) {
+		fprintf(stats_file->file, "\n]\n");
+	}
+	fclose(stats_file->file);
+}
+
+/*! Render the compiled tune headlessly: hash the samples, and measure the render time */
+static void render_tune(struct compile_result_t* result) {
+	result->data_hash = hash_bytes(FNV_OFFSET, result->stream.data, result->stream.data_size);
+	result->sample_hash = FNV_OFFSET;
+	result->sample_count = 0;
+	result->render_time = 0;
+	result->rendered = result->voice_count <= VOICE_COUNT;
+	if (!result->rendered) {
+		return;
+	}
+
+	double start = now();
+	struct stream_reader_t reader;
+	struct frame_ring_t* ring = malloc(sizeof(struct frame_ring_t));
+	struct seq_ctx_t ctx;
+	int8_t block[SEQ_BLOCK_SIZE];
+	stream_reader_init(&reader, &result->stream);
+	frame_ring_init(ring, &reader);
+	frame_ring_fill(ring);
+	seq_ctx_init(&ctx, frame_ring_require, ring);
+	ctx.feed_compensate = (result->stream.options & SEQ_COMPILE_COMPENSATE) != 0;
+	seq_play_stream(&ctx, result->voice_count);
+	while (!ctx.seq_end) {
+		frame_ring_fill(ring);
+		size_t count = seq_render_block(&ctx, block, SEQ_BLOCK_SIZE);
+		result->sample_hash = hash_bytes(result->sample_hash, block, count);
+		result->sample_count += count;
+	}
+	free(ring);
+	result->render_time = now() - start;
+}
+
+/*! A single tune of the batch */
+struct batch_job_t {
+	char* path;
+	char* out_name;
+	int error;
+	struct compile_result_t result;
+	/*! Polyphony statistics, if exported */
+	struct seq_stats_t stats;
+};
+
+/*! The job queue, shared by the worker threads */
+struct batch_t {
+	struct batch_job_t* jobs;
+	int job_count;
+	int next_job;
+	/*! STREAM_* options */
+	int options;
+	const struct seq_cost_model_t* cost;
+	/*! Ref tolerances, if quantized */
+	const struct seq_quantize_t* quantize;
+	/*! Encoding budget, if autotuned */
+	const struct autotune_budget_t* budget;
+	/*! Collect the polyphony statistics */
+	int stats;
+};
+
+static void* batch_worker(void* arg) {
+	struct batch_t* batch = arg;
+	while (1) {
+		int i = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+		if (i >= batch->job_count) {
+			return NULL;
+		}
+		struct batch_job_t* job = &batch->jobs[i];
+		// The per-tune compiler stats are not printed: the summary table reports them.
+		// The batch workers already use the cores of -j: the autotuner runs serially in each
+		job->error = compile_mml(job->path, job->out_name, batch->options, batch->cost, batch->quantize, batch->budget, 1, batch->stats ? &job->stats : NULL, NULL, &job->result);
+		if (!job->error) {
+			render_tune(&job->result);
+		}
+	}
+}
+
+static int has_suffix(const char* name, const char* suffix) {
+	size_t len = strlen(name);
+	size_t suffix_len = strlen(suffix);
+	return len >= suffix_len && !strcmp(name + len - suffix_len, suffix);
+}
+
+static void batch_add(struct batch_t* batch, const char* path, const char* out_dir) {
+	batch->jobs = realloc(batch->jobs, sizeof(struct batch_job_t) * (batch->job_count + 1));
+	struct batch_job_t* job = &batch->jobs[batch->job_count++];
+	memset(job, 0, sizeof(struct batch_job_t));
+	job->path = strdup(path);
+
+	// <out_dir>/<tune>_gen
+	const char* base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	size_t base_len = strlen(base) - (has_suffix(base, ".mml") ? 4 : 0);
+	job->out_name = malloc(strlen(out_dir) + base_len + 6);
+	sprintf(job->out_name, "%s/%.*s_gen", out_dir, (int)base_len, base);
+}
+
+static int job_compare(const void* a, const void* b) {
+	return strcmp(((const struct batch_job_t*)a)->path, ((const struct batch_job_t*)b)->path);
+}
+
+static int batch_scan(struct batch_t* batch, const char* path, const char* out_dir) {
+	DIR* dir = opendir(path);
+	if (!dir) {
+		batch_add(batch, path, out_dir);
+		return 0;
+	}
+	int first = batch->job_count;
+	struct dirent* entry;
+	while ((entry = readdir(dir))) {
+		if (has_suffix(entry->d_name, ".mml")) {
+			char* file = malloc(strlen(path) + strlen(entry->d_name) + 2);
+			sprintf(file, "%s/%s", path, entry->d_name);
+			batch_add(batch, file, out_dir);
+			free(file);
+		}
+	}
+	closedir(dir);
+	if (first == batch->job_count) {
+		fprintf(stderr, "No .mml files in %s\n", path);
+		return 1;
+	}
+	qsort(batch->jobs + first, batch->job_count - first, sizeof(struct batch_job_t), job_compare);
+	return 0;
+}
+
+/*!
+ * Find the hashes of `path` in the golden file, one "<tune> <data hash> <sample hash>" line per tune.
+ * The sample hash is `-` if the tune was not rendered. Returns non-zero if not found.
+ */
+static int golden_find(FILE* file, const char* path, uint64_t* data_hash, char* sample_hash) {
+	char name[FILENAME_MAX];
+	unsigned long long data;
+	rewind(file);
+	while (fscanf(file, "%4095s %llx %16s", name, &data, sample_hash) == 3) {
+		if (!strcmp(name, tune_name(path))) {
+			*data_hash = data;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*! Report the tunes of the golden file that are not in the batch. Returns their count */
+static int golden_stale(FILE* file, const struct batch_t* batch) {
+	char name[FILENAME_MAX];
+	char sample[17];
+	unsigned long long data;
+	int count = 0;
+	rewind(file);
+	while (fscanf(file, "%4095s %llx %16s", name, &data, sample) == 3) {
+		int i = 0;
+		while (i < batch->job_count && strcmp(name, tune_name(batch->jobs[i].path))) {
+			i++;
+		}
+		if (i == batch->job_count) {
+			printf("%s MISSING from the batch\n", name);
+			count++;
+		}
+	}
+	return count;
+}
+
+int compile_batch(char** paths, int path_count, const char* out_dir, int jobs, int options, const struct seq_cost_model_t* cost, const struct seq_quantize_t* quantize, const struct autotune_budget_t* budget, const char* golden, int update_golden, const char* stats_name) {
+	struct batch_t batch = { NULL, 0, 0, options, cost, quantize, budget, stats_name != NULL };
+	for (int i = 0; i < path_count; i++) {
+		if (batch_scan(&batch, paths[i], out_dir)) {
+			return 1;
+		}
+	}
+
+	if (jobs <= 0) {
+		jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (jobs > batch.job_count) {
+		jobs = batch.job_count;
+	}
+
+	pthread_t* threads = malloc(sizeof(pthread_t) * jobs);
+	for (int i = 0; i < jobs; i++) {
+		pthread_create(&threads[i], NULL, batch_worker, &batch);
+	}
+	for (int i = 0; i < jobs; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	FILE* golden_file = NULL;
+	if (golden) {
+		golden_file = fopen(golden, update_golden ? "w" : "r");
+		if (!golden_file) {
+			fprintf(stderr, "Cannot open the golden file %s\n", golden);
+		}
+	}
+
+	struct stats_file_t stats_file;
+	int has_stats = stats_name && !stats_open(&stats_file, stats_name);
+
+	// Summary
+	int errors = 0;
+	int mismatches = 0;
+	int width = 4;
+	for (int i = 0; i < batch.job_count; i++) {
+		int len = (int)strlen(batch.jobs[i].path);
+		if (len > width) {
+			width = len;
+		}
+	}
+	printf("%-*s %7s %6s %6s %5s %5s %5s %5s %5s %5s %10s %12s %10s %10s %16s %16s\n", width, "tune", "frames", "voices", "layout", "time", "per", "amp", "rel", "wave", "step", "bits/frame", "stream size",
+		"compile ms", "Msample/s", "data hash", "sample hash");
+	for (int i = 0; i < batch.job_count; i++) {
+		struct batch_job_t* job = &batch.jobs[i];
+		if (job->error) {
+			printf("%-*s FAILED\n", width, job->path);
+			errors++;
+		} else {
+			struct compile_result_t* result = &job->result;
+			struct bit_stream_t* stream = &result->stream;
+			char sample_hash[17] = "-";
+			if (result->rendered) {
+				sprintf(sample_hash, "%016llx", (unsigned long long)result->sample_hash);
+			}
+			// Tuple streams code the whole frame with a single ref: the field columns are 0
+			printf("%-*s %7d %6d %6s %5d %5d %5d %5d %5d %5d %10d %12d %10.1f %10.1f %016llx %16s", width, job->path, result->frame_count, result->voice_count,
+				(stream->options & STREAM_TUPLES) ? "tuples" : "fields",
+				stream->refs_adsr_time_scale.bit_count, stream->refs_wf_period.bit_count, stream->refs_wf_amplitude.bit_count, stream->refs_adsr_release_start.bit_count, stream->refs_wf_type.bit_count, stream->refs_wf_step.bit_count,
+				stream->refs_adsr_time_scale.bit_count + stream->refs_wf_period.bit_count + stream->refs_wf_amplitude.bit_count + stream->refs_adsr_release_start.bit_count + stream->refs_wf_type.bit_count + stream->refs_wf_step.bit_count + stream->refs_frame.bit_count,
+				stream->data_size, result->compile_time * 1e3, result->render_time > 0 ? result->sample_count / result->render_time * 1e-6 : 0.0,
+				(unsigned long long)result->data_hash, sample_hash);
+
+			if (golden_file && update_golden) {
+				fprintf(golden_file, "%s %016llx %s\n", tune_name(job->path), (unsigned long long)result->data_hash, sample_hash);
+			} else if (golden_file) {
+				uint64_t golden_data_hash;
+				char golden_sample_hash[17];
+				if (golden_find(golden_file, job->path, &golden_data_hash, golden_sample_hash)) {
+					// Not covered by the golden file: only --update-golden adds it
+					printf(" MISSING");
+					mismatches++;
+				} else if (!result->rendered) {
+					// The samples can't be checked, even if the file agrees
+					printf(" NOT RENDERED");
+					mismatches++;
+				} else if (golden_data_hash != result->data_hash || strcmp(golden_sample_hash, sample_hash)) {
+					printf(" MISMATCH");
+					mismatches++;
+				}
+			}
+			printf("\n");
+			if (has_stats) {
+				stats_write(&stats_file, job->path, &job->stats);
+			}
+			stream_free(stream);
+		}
+		seq_stats_free(&job->stats);
+	}
+	if (has_stats) {
+		stats_close(&stats_file);
+	}
+	if (golden_file) {
+		if (!update_golden) {
+			mismatches += golden_stale(golden_file, &batch);
+		}
+		fclose(golden_file);
+		if (mismatches) {
+			printf("%d tunes differ from %s, or are missing\n", mismatches, golden);
+		}
+	}
+	printf("%d tunes compiled, %d failed, %d threads\n", batch.job_count - errors, errors, jobs);
+	for (int i = 0; i < batch.job_count; i++) {
+		free(batch.jobs[i].path);
+		free(batch.jobs[i].out_name);
+	}
+	free(batch.jobs);
+	return errors > 0 || mismatches > 0 || (golden && !golden_file) || (stats_name && !has_stats);
+}
@@ -0,0 +1,101 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, MML tune compiler.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _COMPILE_H
+#define _COMPILE_H
+
+#include "sequencer.h"
+#include <stdio.h>
+
+/*! Result of a tune compilation */
+struct compile_result_t {
+	/*! Frames in the stream */
+	int frame_count;
+	/*! Non-empty channels, as voices to play */
+	int voice_count;
+	/*! Compressed stream */
+	struct bit_stream_t stream;
+	/*! Compilation time, in seconds */
+	double compile_time;
+	/*! Batch only: set if rendered (not if the voices exceed the synth ones) */
+	int rendered;
+	/*! Batch only: rendered samples, and render time in seconds */
+	uint32_t sample_count;
+	double render_time;
+	/*! Batch only: FNV-1a hashes of the generated `tune_data`, and of the rendered samples */
+	uint64_t data_hash;
+	uint64_t sample_hash;
+};
+
+/*! Export file of the polyphony statistics, of one or more tunes */
+struct stats_file_t {
+	FILE* file;
+	/*! JSON if the file name ends with `.json`, CSV otherwise */
+	int json;
+	/*! Tunes written */
+	int count;
+};
+
+/*! Budgets of the encoding autotuner */
+struct autotune_budget_t {
+	/*! Program memory of the stream, its tables and the decoder, in words */
+	int words;
+	/*! Decode cycles of the worst frame */
+	int cycles;
+};
+
+/*! Encodings evaluated by the autotuner, at most */
+#define AUTOTUNE_MAX_CANDIDATES 32
+
+/*!
+ * Compile the MML file `name` to the `<out_name>.c`/`<out_name>.h` sources,
+ * using the STREAM_* `options`, and profile the playback over the `cost` model (if not NULL).
+ * If `quantize` is set, the near-duplicate periods and time scales are merged first (see `seq_quantize`).
+ * If `budget` is set, the stream encoding is chosen by the autotuner instead: the fastest decoding
+ * one that fits, over the `STREAM_COST_MODEL_PIC12F683` model. The candidates are evaluated by `jobs` threads
+ * (0 = one per core, 1 = serially in the calling thread).
+ * If `stats` is not NULL, it receives the polyphony statistics of the playback (to free with `seq_stats_free`).
+ * The compiler stats are printed to `log`, or not at all if NULL (errors always go to stderr).
+ * The compressed stream is returned in `result` (to free with `stream_free`).
+ * Returns non-zero in case of error.
+ */
+int compile_mml(const char* name, const char* out_name, int options, const struct seq_cost_model_t* cost, const struct seq_quantize_t* quantize, const struct autotune_budget_t* budget, int jobs, struct seq_stats_t* stats, FILE* log, struct compile_result_t* result);
+
+/*! Open the statistics file `name`. Returns non-zero in case of error. */
+int stats_open(struct stats_file_t* stats_file, const char* name);
+
+/*! Append the statistics of the `tune` */
+void stats_write(struct stats_file_t* stats_file, const char* tune, const struct seq_stats_t* stats);
+
+void stats_close(struct stats_file_t* stats_file);
+
+/*!
+ * Compile many MML files concurrently, using `jobs` threads (0 = one per core).
+ * `paths` can contain .mml files or directories, scanned for .mml files.
+ * Sources are written in `out_dir` as `<tune>_gen.c`/`<tune>_gen.h`.
+ * The `quantize` tolerances and the `budget`, if set, quantize the refs and autotune the encoding of every tune (see `compile_mml`).
+ * Every tune is also rendered headlessly, to hash the samples and to measure the throughput.
+ * If `golden` is set, the hashes are compared with the ones of the file, or written to it when `update_golden` is set.
+ * A tune missing in the file, a tune of the file missing in the batch and a tune not rendered (`-` sample hash) are mismatches.
+ * If `stats_name` is set, the polyphony statistics of the tunes are exported to it.
+ * Prints a summary table. Returns non-zero if any compilation failed or any hash differs.
+ */
+int compile_batch(char** paths, int path_count, const char* out_dir, int jobs, int options, const struct seq_cost_model_t* cost, const struct seq_quantize_t* quantize, const struct autotune_budget_t* budget, const char* golden, int update_golden, const char* stats_name);
+
+#endif
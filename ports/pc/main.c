@@ -20,180 +20,227 @@
 
 #include "synth.h"
 #include "sequencer.h"
-#include "mml.h"
-#include "codegen.h"
+#include "compile.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <ao/ao.h>
-
-struct poly_synth_t synth;
-
-static int16_t samples[8192];
-static uint16_t samples_sz = 0;
-static struct bit_stream_t bit_stream;
-static int stream_pos;
-static int stream_pos_bit;
-
-/* Read and play a MML file */
-static void mml_error(const char* err, int line, int column) {
-	fprintf(stderr, "Error reading MML file: %s at line %d, pos %d\n", err, line, column);
-}
-
-static int process_mml(const char* name, int* voice_count) {
-	FILE *fp = fopen(name, "r");
-	if (!fp) {
-		fprintf(stderr, "Error reading MML file: %s", name);
-		return 1;
-	}
-	fseek(fp, 0, SEEK_END);
-	long size = ftell(fp);
-   	char* content = malloc(size + 1);
-	fseek(fp, 0, SEEK_SET);
-	fread(content, 1, size, fp);
-	content[size] = 0;
-
-	mml_set_error_handler(mml_error);
-	int err;
-
-	struct seq_frame_map_t map;
-	err = mml_compile(content, &map);
-	if (err) {
-		return err;
-	}
-	free(content);
-	int channel_count = map.channel_count;
-
-	// Sort frames in stream
-	int do_clip_check;
-	struct seq_frame_t* seq_frame_stream;
-	int current_frame;
-	int frame_count;
-	seq_compile(&map, &seq_frame_stream, &frame_count, voice_count, &do_clip_check);
-	mml_free(&map);
-
-	// Compress stream
-	if (stream_compress(seq_frame_stream, frame_count, &bit_stream)) {
-		return 1;
-	}
-	
-	return codegen_write(name, &bit_stream, channel_count, do_clip_check);
-}
-
-static uint8_t read_bits(uint8_t bits) {
-	if (bits) {
-		uint16_t buffer = bit_stream.data[stream_pos] + (bit_stream.data[stream_pos + 1] << 8);
-		buffer >>= stream_pos_bit;
-		uint8_t ret = buffer & ((1 << bits) - 1);
-
-		stream_pos_bit += bits;
-		if (stream_pos_bit >= 8) {
-			stream_pos_bit -= 8;
-			stream_pos++;
-		}
-
-		return ret;
-	} else {
-		return 0;
-	}
-}
-
-void new_frame_require() {
-	uint8_t ref_adsr_time_scale = read_bits(bit_stream.refs_adsr_time_scale.bit_count);
-	uint8_t ref_wf_period = read_bits(bit_stream.refs_wf_period.bit_count);
-	uint8_t ref_wf_amplitude = read_bits(bit_stream.refs_wf_amplitude.bit_count);
-	uint8_t ref_adsr_release_start = read_bits(bit_stream.refs_adsr_release_start.bit_count);
-
-	if (stream_pos >= (bit_stream.data_size - 1) && !ref_adsr_time_scale && !ref_wf_period && !ref_wf_amplitude && !ref_adsr_release_start) {
-		seq_buf_frame.adsr_time_scale_1 = 0;
-	} else {
-		seq_buf_frame.adsr_time_scale_1 = bit_stream.refs_adsr_time_scale.values[ref_adsr_time_scale];
-		seq_buf_frame.wf_period = bit_stream.refs_wf_period.values[ref_wf_period];
-		seq_buf_frame.wf_amplitude = bit_stream.refs_wf_amplitude.values[ref_wf_amplitude];
-		seq_buf_frame.adsr_release_start = bit_stream.refs_adsr_release_start.values[ref_adsr_release_start];
-	}
+#include "output.h"
+#include "player.h"
+
+static int8_t block[SEQ_BLOCK_SIZE];
+
+static void usage() {
+	fprintf(stderr, "Usage: synth [-o FILE] [-f wav|raw8|raw16|null|live] [-r RATE] [--no-live] [--huffman] [--backref] [--tuples|--fields] [--align BITS] [--compensate] [--unroll]\n"
+		"             [--profile] [--cost MODEL] [--quantize CENTS,SAMPLES] [--autotune WORDS,CYCLES] [--stats FILE] compile-mml FILE.mml\n");
+	fprintf(stderr, "       synth [-d DIR] [-j JOBS] [--golden|--update-golden FILE] [--huffman] [--backref] [--tuples|--fields] [--align BITS] [--compensate] [--unroll]\n"
+		"             [--profile] [--cost MODEL] [--quantize CENTS,SAMPLES] [--autotune WORDS,CYCLES] [--stats FILE] compile-batch FILE.mml|DIR...\n");
+	fprintf(stderr, "\t-o FILE\toutput file, - for the standard output (default out.wav)\n");
+	fprintf(stderr, "\t-f FMT\toutput format (default wav)\n");
+	fprintf(stderr, "\t-r RATE\tresample the output to RATE Hz, e.g. 44100 or 48000 (default the synth rate)\n");
+	fprintf(stderr, "\t--no-live\tdon't play on the live audio device\n");
+	fprintf(stderr, "\t-d DIR\toutput folder of the batch sources (default .)\n");
+	fprintf(stderr, "\t-j JOBS\tconcurrent compilations (default one per core)\n");
+	fprintf(stderr, "\t--stats FILE\texport the polyphony statistics to FILE (CSV, or JSON if .json)\n");
+	fprintf(stderr, "\t--golden FILE\tcompare the stream and sample hashes with FILE\n");
+	fprintf(stderr, "\t--update-golden FILE\twrite the stream and sample hashes to FILE\n");
+	fprintf(stderr, "\t--huffman\tcode the stream refs with Huffman codes\n");
+	fprintf(stderr, "\t--backref\tcode the repeated runs of frames as back-references\n");
+	fprintf(stderr, "\t--tuples\tcode each frame as a single ref to the table of the distinct frames\n");
+	fprintf(stderr, "\t--fields\tcode the frame fields separately (default: the smaller layout)\n");
+	fprintf(stderr, "\t--align BITS\tpad the fixed-size refs to 4 or 8 bits, to start the fields at nibble or byte boundaries\n");
+	fprintf(stderr, "\t--compensate\tshorten the notes fed late, to keep the voices in time\n");
+	fprintf(stderr, "\t--unroll\temit a seq_feed_synth and a frame decoder specialized for the tune, in the generated sources\n");
+	fprintf(stderr, "\t--profile\tprofile the per-sample cost of the playback, over the PIC12F683 model\n");
+	fprintf(stderr, "\t--cost MODEL\tprofile over the cycles of the target: budget,window,sample,voice,active,shift,frame,clip\n");
+	fprintf(stderr, "\t--quantize CENTS,SAMPLES\tmerge the periods and time scales within CENTS of pitch and SAMPLES of timing\n");
+	fprintf(stderr, "\t--autotune WORDS,CYCLES\tchoose the fastest decoding encoding in WORDS of program memory and CYCLES per frame\n");
 }
 
 int main(int argc, char** argv) {
-	int voice = 0;
-
-	memset(synth.voice, 0, sizeof(synth.voice));
-
-	ao_sample_format format;
-	memset(&format, 0, sizeof(format));
-	format.bits = 16;
-	format.channels = 1;
-	format.rate = synth_freq;
-	format.byte_format = AO_FMT_NATIVE;
-
-	ao_initialize();
-	int wav_driver = ao_driver_id("wav");
-	ao_device* wav_device = ao_open_file(
-		wav_driver, "out.wav", 1, &format, NULL
-	);
-
-	if (!wav_device) {
-		fprintf(stderr, "Failed to open WAV device\n");
-		return 1;
-	}
-
-	ao_device* live_device = NULL;
-	int live_driver = ao_default_driver_id();
-	live_device = ao_open_live(live_driver, &format, NULL);
-	if (!live_device) {
-		printf("Live driver not available\n");
-	}
+	const char* out_name = "out.wav";
+	enum output_format_t out_format = OUTPUT_WAV;
+	uint32_t out_rate = synth_freq;
+#ifdef HAVE_LIBAO
+	int live = 1;
+#else
+	int live = 0;
+#endif
+	const char* out_dir = ".";
+	int jobs = 0;
+	int options = 0;
+	struct seq_cost_model_t cost_model = SEQ_COST_MODEL_PIC12F683;
+	const struct seq_cost_model_t* cost = NULL;
+	const char* golden = NULL;
+	int update_golden = 0;
+	const char* stats_name = NULL;
+	struct autotune_budget_t budget;
+	const struct autotune_budget_t* autotune = NULL;
+	struct seq_quantize_t tolerance;
+	const struct seq_quantize_t* quantize = NULL;
+
+	adsr_gains_init();
 
 	argc--;
 	argv++;
+	if (argc == 0) {
+		usage();
+		return 1;
+	}
 	while (argc > 0) {
-		/* Check for MML compilation only */
-		if (!strcmp(argv[0], "compile-mml")) {
-			const char* name = argv[1];
+		if (!strcmp(argv[0], "-o") && argc > 1) {
+			out_name = argv[1];
 			argv++;
 			argc--;
-			
-			int voice_count;
-			if (process_mml(name, &voice_count)) {
+		} else if (!strcmp(argv[0], "-f") && argc > 1) {
+			if (output_parse_format(argv[1], &out_format)) {
+				fprintf(stderr, "Unknown output format: %s\n", argv[1]);
 				return 1;
 			}
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "-r") && argc > 1) {
+			out_rate = atoi(argv[1]);
+			if (out_rate == 0) {
+				fprintf(stderr, "Invalid output rate: %s\n", argv[1]);
+				return 1;
+			}
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "--no-live")) {
+			live = 0;
+		} else if (!strcmp(argv[0], "--huffman")) {
+			options |= STREAM_HUFFMAN;
+		} else if (!strcmp(argv[0], "--backref")) {
+			options |= STREAM_BACKREF;
+		} else if (!strcmp(argv[0], "--tuples")) {
+			options = (options & ~STREAM_FIELDS) | STREAM_TUPLES;
+		} else if (!strcmp(argv[0], "--compensate")) {
+			options |= SEQ_COMPILE_COMPENSATE;
+		} else if (!strcmp(argv[0], "--unroll")) {
+			options |= SEQ_CODEGEN_UNROLL;
+		} else if (!strcmp(argv[0], "--fields")) {
+			options = (options & ~STREAM_TUPLES) | STREAM_FIELDS;
+		} else if (!strcmp(argv[0], "--align") && argc > 1) {
+			int bits = atoi(argv[1]);
+			if (bits != 4 && bits != 8) {
+				fprintf(stderr, "Invalid alignment: %s\n", argv[1]);
+				return 1;
+			}
+			options = (options & ~(STREAM_ALIGN_NIBBLE | STREAM_ALIGN_BYTE)) | (bits == 4 ? STREAM_ALIGN_NIBBLE : STREAM_ALIGN_BYTE);
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "--quantize") && argc > 1) {
+			if (sscanf(argv[1], "%lf,%d", &tolerance.cents, &tolerance.samples) != 2 || tolerance.cents < 0 || tolerance.samples < 0) {
+				fprintf(stderr, "Invalid quantization tolerance: %s\n", argv[1]);
+				return 1;
+			}
+			quantize = &tolerance;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "--autotune") && argc > 1) {
+			if (sscanf(argv[1], "%d,%d", &budget.words, &budget.cycles) != 2 || budget.words <= 0 || budget.cycles <= 0) {
+				fprintf(stderr, "Invalid autotune budget: %s\n", argv[1]);
+				return 1;
+			}
+			autotune = &budget;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "--profile")) {
+			cost = &cost_model;
+		} else if (!strcmp(argv[0], "--cost") && argc > 1) {
+			if (sscanf(argv[1], "%d,%d,%d,%d,%d,%d,%d,%d", &cost_model.budget, &cost_model.window, &cost_model.sample, &cost_model.voice,
+				&cost_model.active, &cost_model.shift, &cost_model.frame, &cost_model.clip) != 8 || cost_model.budget <= 0 || cost_model.window <= 0) {
+				fprintf(stderr, "Invalid cost model: %s\n", argv[1]);
+				return 1;
+			}
+			cost = &cost_model;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "-d") && argc > 1) {
+			out_dir = argv[1];
+			argv++;
+			argc--;
+		} else if ((!strcmp(argv[0], "--golden") || !strcmp(argv[0], "--update-golden")) && argc > 1) {
+			update_golden = !strcmp(argv[0], "--update-golden");
+			golden = argv[1];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "--stats") && argc > 1) {
+			stats_name = argv[1];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "-j") && argc > 1) {
+			jobs = atoi(argv[1]);
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "compile-batch") && argc > 1) {
+			/* Compile all the remaining files, without playing them */
+			return compile_batch(argv + 1, argc - 1, out_dir, jobs, options, cost, quantize, autotune, golden, update_golden, stats_name);
+		} else if (!strcmp(argv[0], "compile-mml") && argc > 1) {
+			/* Check for MML compilation only */
+			const char* name = argv[1];
+			argv++;
+			argc--;
 
-			stream_pos = 0;
-			stream_pos_bit = 0;
-
-			seq_play_stream(voice_count);
-		}
-		argv++;
-		argc--;
-
-		/* Play out any remaining samples */
-		while (!seq_end) {
-			int16_t* sample_ptr = samples;
-			uint16_t samples_remain = sizeof(samples) / sizeof(uint16_t);
+			struct output_t output;
+			if (output_open(&output, out_format, out_name, synth_freq, out_rate)) {
+				return 1;
+			}
+			struct output_t live_output;
+			int has_live = live && out_format != OUTPUT_LIVE && !output_open(&live_output, OUTPUT_LIVE, NULL, synth_freq, out_rate);
+
+			// Keep the standard output for the samples, if written there
+			FILE* log = !strcmp(out_name, "-") ? stderr : stdout;
+			struct compile_result_t result;
+			struct seq_stats_t stats;
+			if (compile_mml(name, "tune_gen", options, cost, quantize, autotune, 0, stats_name ? &stats : NULL, log, &result)) {
+				return 1;
+			}
+			if (stats_name) {
+				struct stats_file_t stats_file;
+				if (stats_open(&stats_file, stats_name)) {
+					return 1;
+				}
+				stats_write(&stats_file, name, &stats);
+				stats_close(&stats_file);
+				seq_stats_free(&stats);
+			}
 
-			/* Fill the buffer as much as we can */
-			while (!seq_end && samples_remain) {
-				int16_t s = seq_feed_synth();
-				*sample_ptr = s << 8;
-				sample_ptr++;
-				samples_sz++;
-				samples_remain--;
+			struct stream_reader_t reader;
+			stream_reader_init(&reader, &result.stream);
+			static struct frame_ring_t ring;
+			frame_ring_init(&ring, &reader);
+			frame_ring_fill(&ring);
+			struct seq_ctx_t ctx;
+			seq_ctx_init(&ctx, frame_ring_require, &ring);
+			ctx.feed_compensate = (options & SEQ_COMPILE_COMPENSATE) != 0;
+			seq_play_stream(&ctx, result.voice_count);
+
+			/* Play out any remaining samples */
+			while (!ctx.seq_end) {
+				/* At most a frame is fed per sample: a block never drains the refilled ring */
+				frame_ring_fill(&ring);
+				size_t samples_sz = seq_render_block(&ctx, block, SEQ_BLOCK_SIZE);
+				if (output_write(&output, block, samples_sz)) {
+					fprintf(stderr, "Error writing the output\n");
+					return 1;
+				}
+				if (has_live) {
+					output_write(&live_output, block, samples_sz);
+				}
 			}
-			ao_play(wav_device, (char*)samples, 2*samples_sz);
 
-			if (live_device) {
-				ao_play(
-					live_device,
-					(char*)samples, 2*samples_sz
-				);
+			output_close(&output);
+			if (has_live) {
+				output_close(&live_output);
 			}
-			samples_sz = 0;
+			stream_free(&result.stream);
+		} else {
+			usage();
+			return 1;
 		}
+		argv++;
+		argc--;
 	}
-
-	ao_close(wav_device);
-	if (live_device) {
-		ao_close(live_device);
-	}
-	ao_shutdown();
 	return 0;
 }
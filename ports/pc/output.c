@@ -0,0 +1,232 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, audio output backends.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "output.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBAO
+#include <ao/ao.h>
+#endif
+
+#define WAV_HEADER_SIZE 44
+
+static const char* format_names[] = { "wav", "raw8", "raw16", "null", "live" };
+
+int output_parse_format(const char* name, enum output_format_t* format) {
+	for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+		if (!strcmp(name, format_names[i])) {
+			*format = (enum output_format_t)i;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void put_le16(uint8_t* ptr, uint16_t value) {
+	ptr[0] = value & 0xff;
+	ptr[1] = value >> 8;
+}
+
+static void put_le32(uint8_t* ptr, uint32_t value) {
+	put_le16(ptr, value & 0xffff);
+	put_le16(ptr + 2, value >> 16);
+}
+
+/*! Write the 16-bit mono PCM header, with the data size of `sample_count` samples */
+static void wav_write_header(FILE* file, uint32_t rate, uint32_t sample_count) {
+	uint8_t header[WAV_HEADER_SIZE];
+	uint32_t data_size = sample_count * 2;
+	memcpy(header, "RIFF", 4);
+	put_le32(header + 4, 36 + data_size);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_le32(header + 16, 16);
+	// PCM, mono
+	put_le16(header + 20, 1);
+	put_le16(header + 22, 1);
+	put_le32(header + 24, rate);
+	put_le32(header + 28, rate * 2);
+	put_le16(header + 32, 2);
+	put_le16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	put_le32(header + 40, data_size);
+	fwrite(header, 1, WAV_HEADER_SIZE, file);
+}
+
+/*! Free the buffers of a failed or closed output */
+static void output_free(struct output_t* output) {
+	if (output->resampler) {
+		resampler_free(output->resampler);
+		free(output->resampler);
+		free(output->resampled);
+	}
+	free(output->buffer);
+}
+
+int output_open(struct output_t* output, enum output_format_t format, const char* name, uint32_t synth_rate, uint32_t rate) {
+	memset(output, 0, sizeof(struct output_t));
+	output->format = format;
+	output->rate = rate;
+
+	if (rate != synth_rate) {
+		if (format == OUTPUT_RAW8) {
+			fprintf(stderr, "The raw8 output is at the synth rate only\n");
+			return 1;
+		}
+		// Also for the null output, to benchmark the resampler
+		output->resampler = malloc(sizeof(struct resampler_t));
+		if (!output->resampler || resampler_init(output->resampler, synth_rate, rate)) {
+			fprintf(stderr, "Cannot resample from %d to %d Hz\n", (int)synth_rate, (int)rate);
+			free(output->resampler);
+			output->resampler = NULL;
+			return 1;
+		}
+		output->resampled = malloc(OUTPUT_BUFFER_SIZE * sizeof(int16_t));
+		output->resample_block = resampler_max_input(output->resampler, OUTPUT_BUFFER_SIZE);
+	}
+
+	if (format == OUTPUT_NULL) {
+		return 0;
+	}
+
+	output->buffer = malloc(OUTPUT_BUFFER_SIZE * 2);
+
+	if (format == OUTPUT_LIVE) {
+#ifdef HAVE_LIBAO
+		ao_sample_format ao_format;
+		memset(&ao_format, 0, sizeof(ao_format));
+		ao_format.bits = 16;
+		ao_format.channels = 1;
+		ao_format.rate = rate;
+		ao_format.byte_format = AO_FMT_LITTLE;
+
+		ao_initialize();
+		output->device = ao_open_live(ao_default_driver_id(), &ao_format, NULL);
+		if (output->device) {
+			return 0;
+		}
+		ao_shutdown();
+#endif
+		fprintf(stderr, "Live driver not available\n");
+		output_free(output);
+		return 1;
+	}
+
+	if (!strcmp(name, "-")) {
+		// The standard output is for the samples only: the caller writes its diagnostics to stderr
+		output->file = stdout;
+	} else {
+		output->file = fopen(name, "wb");
+		if (!output->file) {
+			fprintf(stderr, "Cannot write the output file %s\n", name);
+			output_free(output);
+			return 1;
+		}
+	}
+	setvbuf(output->file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE * 2);
+
+	if (format == OUTPUT_WAV) {
+		// Unknown length: completed by `output_close` if the file is seekable
+		wav_write_header(output->file, rate, UINT32_MAX / 2 - WAV_HEADER_SIZE);
+	}
+	return 0;
+}
+
+/*! Play or write `size` 16-bit samples of the conversion buffer */
+static int output_emit(struct output_t* output, size_t size) {
+	if (output->format == OUTPUT_LIVE) {
+#ifdef HAVE_LIBAO
+		ao_play(output->device, (char*)output->buffer, size * 2);
+#endif
+		return 0;
+	}
+	return fwrite(output->buffer, 2, size, output->file) != size;
+}
+
+/*! Write the samples of the resampler (at most `OUTPUT_BUFFER_SIZE`) */
+static int output_write16(struct output_t* output, const int16_t* samples, size_t count) {
+	output->sample_count += count;
+	if (output->format == OUTPUT_NULL) {
+		return 0;
+	}
+	for (size_t i = 0; i < count; i++) {
+		put_le16(output->buffer + i * 2, (uint16_t)samples[i]);
+	}
+	return output_emit(output, count);
+}
+
+int output_write(struct output_t* output, const int8_t* samples, size_t count) {
+	if (output->resampler) {
+		while (count) {
+			size_t size = count > output->resample_block ? output->resample_block : count;
+			size_t out_count = resampler_run(output->resampler, samples, size, output->resampled);
+			if (output_write16(output, output->resampled, out_count)) {
+				return 1;
+			}
+			samples += size;
+			count -= size;
+		}
+		return 0;
+	}
+
+	output->sample_count += count;
+	if (output->format == OUTPUT_NULL) {
+		return 0;
+	}
+	if (output->format == OUTPUT_RAW8) {
+		return fwrite(samples, 1, count, output->file) != count;
+	}
+
+	while (count) {
+		size_t size = count > OUTPUT_BUFFER_SIZE ? OUTPUT_BUFFER_SIZE : count;
+
+		// Widen to 16-bit little-endian
+		uint8_t* ptr = output->buffer;
+		for (size_t i = 0; i < size; i++) {
+			*(ptr++) = 0;
+			*(ptr++) = (uint8_t)samples[i];
+		}
+
+		if (output_emit(output, size)) {
+			return 1;
+		}
+		samples += size;
+		count -= size;
+	}
+	return 0;
+}
+
+void output_close(struct output_t* output) {
+	if (output->resampler) {
+		// The samples held by the filter delay
+		output_write16(output, output->resampled, resampler_flush(output->resampler, output->resampled));
+	}
+	if (output->format == OUTPUT_LIVE) {
+#ifdef HAVE_LIBAO
+		ao_close(output->device);
+		ao_shutdown();
+#endif
+	} else if (output->file) {
+		if (output->format == OUTPUT_WAV && !fseek(output->file, 0, SEEK_SET)) {
+			wav_write_header(output->file, output->rate, output->sample_count);
+		}
+		fclose(output->file);
+	}
+	output_free(output);
+}
@@ -0,0 +1,82 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, audio output backends.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include "resample.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*! Output backends */
+enum output_format_t {
+	/*! 16-bit mono WAV file */
+	OUTPUT_WAV,
+	/*! Raw signed 8-bit PCM (the synth native format) */
+	OUTPUT_RAW8,
+	/*! Raw signed 16-bit little-endian PCM */
+	OUTPUT_RAW16,
+	/*! Discard the samples, for benchmarking */
+	OUTPUT_NULL,
+	/*! Live audio device, through libao (only if built with HAVE_LIBAO) */
+	OUTPUT_LIVE
+};
+
+/*! Size of the conversion buffer, in samples */
+#define OUTPUT_BUFFER_SIZE 0x10000
+
+/*! An opened output */
+struct output_t {
+	enum output_format_t format;
+	FILE* file;
+	/*! Sample rate */
+	uint32_t rate;
+	/*! Samples written so far */
+	uint32_t sample_count;
+	/*! Sample format conversion buffer */
+	uint8_t* buffer;
+	/*! Resampler, when the rate differs from the synth one, its output buffer and its input block size */
+	struct resampler_t* resampler;
+	int16_t* resampled;
+	size_t resample_block;
+	/*! libao device, for `OUTPUT_LIVE` */
+	void* device;
+};
+
+/*!
+ * Parse the format name (`wav`, `raw8`, `raw16`, `null` or `live`).
+ * Returns non-zero if unknown.
+ */
+int output_parse_format(const char* name, enum output_format_t* format);
+
+/*!
+ * Open the output. `name` is the output file, or `-` for the standard output (then reserved to the samples).
+ * The synth samples at `synth_rate` are resampled to `rate` when they differ (not for `raw8`).
+ * Returns non-zero in case of error.
+ */
+int output_open(struct output_t* output, enum output_format_t format, const char* name, uint32_t synth_rate, uint32_t rate);
+
+/*! Write a block of synth samples, converting them to the output format */
+int output_write(struct output_t* output, const int8_t* samples, size_t count);
+
+/*! Flush and close the output, completing the file headers */
+void output_close(struct output_t* output);
+
+#endif
@@ -0,0 +1,159 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, stream player.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "player.h"
+#include <string.h>
+
+void stream_reader_init(struct stream_reader_t* reader, struct bit_stream_t* stream) {
+	memset(reader, 0, sizeof(struct stream_reader_t));
+	reader->stream = stream;
+}
+
+static uint8_t read_bits(struct stream_reader_t* reader, uint8_t bits) {
+	if (bits) {
+		const uint8_t* data = reader->stream->data;
+		uint16_t buffer = data[reader->pos] + (data[reader->pos + 1] << 8);
+		buffer >>= reader->pos_bit;
+		uint8_t ret = buffer & ((1 << bits) - 1);
+
+		reader->pos_bit += bits;
+		if (reader->pos_bit >= 8) {
+			reader->pos_bit -= 8;
+			reader->pos++;
+		}
+
+		return ret;
+	} else {
+		return 0;
+	}
+}
+
+/*! Decode a canonical Huffman code, a bit at a time */
+static uint8_t read_code(struct stream_reader_t* reader, const struct ref_map_t* refs) {
+	uint8_t code = 0;
+	uint8_t first = 0;
+	uint8_t index = 0;
+	for (int i = 0; i < refs->bit_count; i++) {
+		code |= read_bits(reader, 1);
+		uint8_t count = refs->code_counts[i];
+		if ((uint8_t)(code - first) < count) {
+			return index + (code - first);
+		}
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+	}
+	return 0;
+}
+
+static uint8_t read_ref(struct stream_reader_t* reader, const struct ref_map_t* refs) {
+	if (reader->stream->options & STREAM_HUFFMAN) {
+		return read_code(reader, refs);
+	} else {
+		return read_bits(reader, refs->bit_count);
+	}
+}
+
+/*! Read a raw value, low byte first */
+static int read_value(struct stream_reader_t* reader, int bits) {
+	if (bits > 8) {
+		int value = read_bits(reader, 8);
+		return value | (read_bits(reader, bits - 8) << 8);
+	}
+	return read_bits(reader, bits);
+}
+
+void stream_read_frame(struct stream_reader_t* reader, struct seq_frame_t* frame) {
+	struct bit_stream_t* bit_stream = reader->stream;
+	// The first ref: the time scale, or the whole frame in the tuple layout
+	const struct ref_map_t* lead_refs = (bit_stream->options & STREAM_TUPLES) ? &bit_stream->refs_frame : &bit_stream->refs_adsr_time_scale;
+	uint8_t ref_adsr_time_scale = read_ref(reader, lead_refs);
+	if ((bit_stream->options & STREAM_BACKREF) && ref_adsr_time_scale == bit_stream->escape_ref) {
+		int length = read_bits(reader, STREAM_BACKREF_LENGTH_BITS);
+		if (!length) {
+			// End of stream
+			frame->adsr_time_scale_1 = 0;
+			return;
+		}
+		// Jump to the run, and play it
+		int bit = read_bits(reader, 3);
+		int offset = read_value(reader, bit_stream->backref_offset_bits);
+		reader->backref_count = length;
+		reader->backref_pos = reader->pos;
+		reader->backref_pos_bit = reader->pos_bit;
+		reader->pos = offset;
+		reader->pos_bit = bit;
+		ref_adsr_time_scale = read_ref(reader, lead_refs);
+	}
+	uint8_t ref_wf_period, ref_wf_amplitude, ref_adsr_release_start, ref_wf_type, ref_wf_step;
+	if (bit_stream->options & STREAM_TUPLES) {
+		// Same row in all the columns
+		ref_wf_period = ref_wf_amplitude = ref_adsr_release_start = ref_wf_type = ref_wf_step = ref_adsr_time_scale;
+	} else {
+		ref_wf_period = read_ref(reader, &bit_stream->refs_wf_period);
+		ref_wf_amplitude = read_ref(reader, &bit_stream->refs_wf_amplitude);
+		ref_adsr_release_start = read_ref(reader, &bit_stream->refs_adsr_release_start);
+		ref_wf_type = read_ref(reader, &bit_stream->refs_wf_type);
+		ref_wf_step = read_ref(reader, &bit_stream->refs_wf_step);
+	}
+
+	// Huffman, back-referenced, tuple and aligned streams end with an explicit frame
+	if (!(bit_stream->options & STREAM_END_FRAME) && reader->pos >= (bit_stream->data_size - 2) && !ref_adsr_time_scale && !ref_wf_period && !ref_wf_amplitude && !ref_adsr_release_start && !ref_wf_type && !ref_wf_step) {
+		frame->adsr_time_scale_1 = 0;
+	} else {
+		frame->adsr_time_scale_1 = bit_stream->refs_adsr_time_scale.values[ref_adsr_time_scale];
+		frame->wf_period = bit_stream->refs_wf_period.values[ref_wf_period];
+		frame->wf_amplitude = bit_stream->refs_wf_amplitude.values[ref_wf_amplitude];
+		frame->adsr_release_start = bit_stream->refs_adsr_release_start.values[ref_adsr_release_start];
+		frame->wf_type = bit_stream->refs_wf_type.values[ref_wf_type];
+		frame->wf_step = bit_stream->refs_wf_step.values[ref_wf_step];
+	}
+
+	if (reader->backref_count && !--reader->backref_count) {
+		// End of the run
+		reader->pos = reader->backref_pos;
+		reader->pos_bit = reader->backref_pos_bit;
+	}
+}
+
+
+void frame_ring_init(struct frame_ring_t* ring, struct stream_reader_t* reader) {
+	ring->reader = reader;
+	ring->head = ring->tail = 0;
+	ring->end = 0;
+}
+
+void frame_ring_fill(struct frame_ring_t* ring) {
+	while (!ring->end && ring->tail - ring->head < FRAME_RING_SIZE) {
+		struct seq_frame_t* frame = &ring->frames[ring->tail++ & (FRAME_RING_SIZE - 1)];
+		stream_read_frame(ring->reader, frame);
+		ring->end = !frame->adsr_time_scale_1;
+	}
+}
+
+void frame_ring_require(struct seq_ctx_t* ctx) {
+	struct frame_ring_t* ring = ctx->frame_source;
+	if (ring->head != ring->tail) {
+		ctx->seq_buf_frame = ring->frames[ring->head++ & (FRAME_RING_SIZE - 1)];
+	} else {
+		// Drained only after the end frame
+		ctx->seq_buf_frame.adsr_time_scale_1 = 0;
+	}
+}
@@ -0,0 +1,69 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, stream player.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _PLAYER_H
+#define _PLAYER_H
+
+#include "synth.h"
+#include "sequencer.h"
+
+#if SEQ_BLOCK_SIZE > FRAME_RING_SIZE
+// At most a frame is fed per sample: a rendered block must not drain the refilled ring
+#error "SEQ_BLOCK_SIZE must not exceed FRAME_RING_SIZE"
+#endif
+
+/*! Frame source of the player: the compressed stream and its read position */
+struct stream_reader_t {
+	struct bit_stream_t* stream;
+	int pos;
+	int pos_bit;
+	/*! Frames left in the back-referenced run, and the position to return to */
+	int backref_count;
+	int backref_pos;
+	int backref_pos_bit;
+};
+
+/*! Start reading `stream` from the beginning */
+void stream_reader_init(struct stream_reader_t* reader, struct bit_stream_t* stream);
+
+/*! Decode the next frame of the stream. The end of the stream is a zero time scale */
+void stream_read_frame(struct stream_reader_t* reader, struct seq_frame_t* frame);
+
+/*!
+ * Frames decoded ahead of the render loop: the sequencer only pops ready frames,
+ * and the bit-stream decoder runs between the rendered blocks.
+ */
+struct frame_ring_t {
+	struct stream_reader_t* reader;
+	struct seq_frame_t frames[FRAME_RING_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	/*! The end frame was decoded */
+	int end;
+};
+
+void frame_ring_init(struct frame_ring_t* ring, struct stream_reader_t* reader);
+
+/*! Decode frames until the ring is full, or the stream ends */
+void frame_ring_fill(struct frame_ring_t* ring);
+
+/*! The `new_frame_require` handler of the context: pops a ready frame from the ring (the `frame_source`) */
+void frame_ring_require(struct seq_ctx_t* ctx);
+
+#endif
@@ -21,7 +21,9 @@
  * MA  02110-1301  USA
  */
 
+#ifndef SYNTH_FREQ
 #define SYNTH_FREQ		(4883*2)
+#endif
 
 /*! Type for time scale, samples per unit. 
  * 16 bits would allow 2^24 samples of maximum note duration and a total duration of 255 time unit.
@@ -31,9 +33,35 @@
 #define TIME_SCALE_MAX  UINT16_MAX
 #define CHANNEL_MASK_T  uint8_t
 
+#ifndef VOICE_COUNT
 #define VOICE_COUNT 8
+#endif
+
+/*! Size of the mixing buffer of `seq_render_block`, in samples */
+#define SEQ_BLOCK_SIZE 1024
+
+/*! Frames decoded ahead of the render loop by the player (power of two) */
+#define FRAME_RING_SIZE 1024
+
+/*! Mix the voices with the SSE2/AVX2 kernel of `voice_simd.c` */
+#if defined(__SSE2__)
+#define VOICE_MIX_SIMD
+#endif
+
+/*! Keep the engine state in `struct seq_ctx_t` contexts, to play more tunes concurrently */
+#define SEQ_REENTRANT
 
 #define CHECK_CLIPPING
-extern int clip_count;
+
+/*! Support the compensation of the late frame feeds, enabled per stream by `SEQ_COMPILE_COMPENSATE` */
+#define SEQ_FEED_COMPENSATE
+
+/*! All the waveform generators, for the compiler and the player */
+#define WAVEFORM_SAWTOOTH
+#define WAVEFORM_TRIANGLE
+#define WAVEFORM_NOISE
+
+/*! Table-driven envelopes, with all the shapes (`adsr_gains`, filled by `adsr_gains_init`) */
+#define ADSR_TABLE
 
 #endif
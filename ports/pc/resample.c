@@ -0,0 +1,203 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, band-limited resampler.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "resample.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+/*! Modified Bessel function of the first kind, for the Kaiser window */
+static double bessel_i0(double x) {
+	double sum = 1;
+	double term = 1;
+	for (int k = 1; k < 50 && term > sum * 1e-12; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+/*! Windowed sinc at `x` input samples from the center, with the `cutoff` in cycles per input sample */
+static double filter_kernel(double x, double cutoff, double half_width) {
+	double r = x / half_width;
+	if (r <= -1 || r >= 1) {
+		return 0;
+	}
+	double sinc = x == 0 ? 1 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+	return 2 * cutoff * sinc * bessel_i0(RESAMPLE_KAISER_BETA * sqrt(1 - r * r)) / bessel_i0(RESAMPLE_KAISER_BETA);
+}
+
+/*! Coefficients of the fractional position `frac` (0..1), normalized to a unity DC gain */
+static void filter_row(float* row, int taps, double frac, double cutoff) {
+	double sum = 0;
+	double values[taps];
+	for (int i = 0; i < taps; i++) {
+		// The i-th sample of the window is at `taps / 2 - 1 - i` samples from the output position
+		values[i] = filter_kernel(frac + taps / 2 - 1 - i, cutoff, taps / 2);
+		sum += values[i];
+	}
+	for (int i = 0; i < taps; i++) {
+		row[i] = (float)(values[i] / sum);
+	}
+}
+
+int resampler_init(struct resampler_t* resampler, uint32_t in_rate, uint32_t out_rate) {
+	memset(resampler, 0, sizeof(struct resampler_t));
+	if (!in_rate || !out_rate) {
+		return 1;
+	}
+	resampler->in_rate = in_rate;
+	resampler->out_rate = out_rate;
+
+	// When downsampling, the cutoff is the output Nyquist frequency: widen the filter accordingly
+	double ratio = out_rate < in_rate ? (double)out_rate / in_rate : 1;
+	double cutoff = RESAMPLE_CUTOFF * ratio;
+	int taps = (int)ceil(RESAMPLE_TAPS / ratio);
+	taps = (taps + 3) & ~3;
+	resampler->taps = taps;
+
+	size_t table_size = RESAMPLE_PHASES * taps * sizeof(float);
+	resampler->coefs = aligned_alloc(16, table_size);
+	resampler->deltas = aligned_alloc(16, table_size);
+	resampler->history = calloc(taps * 2, sizeof(float));
+	float* next = malloc(taps * sizeof(float));
+	if (!resampler->coefs || !resampler->deltas || !resampler->history || !next) {
+		free(next);
+		resampler_free(resampler);
+		return 1;
+	}
+
+	filter_row(resampler->coefs, taps, 0, cutoff);
+	for (int p = 0; p < RESAMPLE_PHASES; p++) {
+		float* row = resampler->coefs + p * taps;
+		filter_row(next, taps, (double)(p + 1) / RESAMPLE_PHASES, cutoff);
+		for (int i = 0; i < taps; i++) {
+			resampler->deltas[p * taps + i] = next[i] - row[i];
+		}
+		if (p + 1 < RESAMPLE_PHASES) {
+			memcpy(row + taps, next, taps * sizeof(float));
+		}
+	}
+	free(next);
+
+	resampler->step = ((uint64_t)in_rate << 32) / out_rate;
+	// The window starts with zeros: the first output, aligned to the first input, waits for half of the filter
+	resampler->phase = (uint64_t)(taps / 2 + 1) << 32;
+	return 0;
+}
+
+size_t resampler_max_input(const struct resampler_t* resampler, size_t out_size) {
+	return (uint64_t)(out_size - 2) * resampler->in_rate / resampler->out_rate;
+}
+
+/*! Filter the history window at the current phase */
+static int16_t resampler_output(const struct resampler_t* resampler) {
+	const float* window = resampler->history + resampler->history_pos;
+	uint32_t frac = (uint32_t)resampler->phase;
+	int phase = frac >> 24;
+	const float* row = resampler->coefs + phase * resampler->taps;
+	const float* delta = resampler->deltas + phase * resampler->taps;
+	float weight = (frac & 0xffffff) * (1.0f / 0x1000000);
+
+	float sum;
+	float sum_delta;
+#ifdef __SSE__
+	__m128 acc = _mm_setzero_ps();
+	__m128 acc_delta = _mm_setzero_ps();
+	for (int i = 0; i < resampler->taps; i += 4) {
+		__m128 x = _mm_loadu_ps(window + i);
+		acc = _mm_add_ps(acc, _mm_mul_ps(x, _mm_load_ps(row + i)));
+		acc_delta = _mm_add_ps(acc_delta, _mm_mul_ps(x, _mm_load_ps(delta + i)));
+	}
+	float lanes[4];
+	float lanes_delta[4];
+	_mm_storeu_ps(lanes, acc);
+	_mm_storeu_ps(lanes_delta, acc_delta);
+	sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	sum_delta = (lanes_delta[0] + lanes_delta[1]) + (lanes_delta[2] + lanes_delta[3]);
+#else
+	sum = 0;
+	sum_delta = 0;
+	for (int i = 0; i < resampler->taps; i++) {
+		sum += window[i] * row[i];
+		sum_delta += window[i] * delta[i];
+	}
+#endif
+
+	// Synth samples are 8-bit: scale to the 16-bit range
+	float value = (sum + weight * sum_delta) * 256;
+	if (value >= INT16_MAX) {
+		return INT16_MAX;
+	}
+	if (value <= INT16_MIN) {
+		return INT16_MIN;
+	}
+	return (int16_t)(value + (value >= 0 ? 0.5f : -0.5f));
+}
+
+/*! Push a sample into the history, and write the outputs whose window is complete */
+static size_t resampler_push(struct resampler_t* resampler, float sample, int16_t* out, uint64_t out_limit) {
+	int taps = resampler->taps;
+	resampler->history[resampler->history_pos] = sample;
+	resampler->history[resampler->history_pos + taps] = sample;
+	if (++resampler->history_pos == taps) {
+		resampler->history_pos = 0;
+	}
+	resampler->phase -= (uint64_t)1 << 32;
+
+	size_t count = 0;
+	while (resampler->phase < ((uint64_t)1 << 32) && resampler->out_count < out_limit) {
+		out[count++] = resampler_output(resampler);
+		resampler->phase += resampler->step;
+		resampler->out_count++;
+	}
+	return count;
+}
+
+size_t resampler_run(struct resampler_t* resampler, const int8_t* samples, size_t count, int16_t* out) {
+	size_t out_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		out_count += resampler_push(resampler, samples[i], out + out_count, UINT64_MAX);
+	}
+	resampler->in_count += count;
+	return out_count;
+}
+
+size_t resampler_flush(struct resampler_t* resampler, int16_t* out) {
+	// The outputs up to the end of the input, at `in_count` samples
+	uint64_t out_limit = (resampler->in_count * resampler->out_rate + resampler->in_rate - 1) / resampler->in_rate;
+	size_t out_count = 0;
+	for (int i = resampler->taps / 2; i > 0; i--) {
+		out_count += resampler_push(resampler, 0, out + out_count, out_limit);
+	}
+	return out_count;
+}
+
+void resampler_free(struct resampler_t* resampler) {
+	free(resampler->coefs);
+	free(resampler->deltas);
+	free(resampler->history);
+	resampler->coefs = NULL;
+	resampler->deltas = NULL;
+	resampler->history = NULL;
+}
@@ -0,0 +1,74 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, band-limited resampler.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*! Phases of the filter table: the ones in between are linearly interpolated */
+#define RESAMPLE_PHASES 256
+/*! Filter taps per output sample, when upsampling (multiple of 4) */
+#define RESAMPLE_TAPS 48
+/*! Cutoff, relative to the lower Nyquist frequency, and Kaiser window shape (about -70dB of stopband) */
+#define RESAMPLE_CUTOFF 0.45
+#define RESAMPLE_KAISER_BETA 7.0
+
+/*!
+ * Streaming polyphase resampler of the synth samples, with a Kaiser-windowed sinc filter.
+ * The filter table and the input history are allocated once: the memory is constant.
+ */
+struct resampler_t {
+	uint32_t in_rate;
+	uint32_t out_rate;
+	/*! Taps of a phase (a multiple of 4, for the SIMD dot product) */
+	int taps;
+	/*! `RESAMPLE_PHASES` rows of `taps` coefficients, and the deltas to the next row */
+	float* coefs;
+	float* deltas;
+	/*! Last `taps` input samples, written twice so that the window is always contiguous */
+	float* history;
+	int history_pos;
+	/*! Input advance per output sample, and position of the next output in the history window (32.32 fixed point) */
+	uint64_t step;
+	uint64_t phase;
+	/*! Samples consumed and produced */
+	uint64_t in_count;
+	uint64_t out_count;
+};
+
+/*! Build the filter for the `in_rate` to `out_rate` conversion. Returns non-zero in case of error. */
+int resampler_init(struct resampler_t* resampler, uint32_t in_rate, uint32_t out_rate);
+
+/*! Input samples whose output always fits `out_size` samples */
+size_t resampler_max_input(const struct resampler_t* resampler, size_t out_size);
+
+/*!
+ * Resample `count` synth samples to `out`, as 16-bit samples. Returns the output count.
+ * The output is delayed by half of the filter: `resampler_flush` ends the stream.
+ */
+size_t resampler_run(struct resampler_t* resampler, const int8_t* samples, size_t count, int16_t* out);
+
+/*! Write to `out` the tail of the stream, held by the filter delay (less than `RESAMPLE_TAPS * out_rate / in_rate` samples). Returns the output count. */
+size_t resampler_flush(struct resampler_t* resampler, int16_t* out);
+
+void resampler_free(struct resampler_t* resampler);
+
+#endif
@@ -0,0 +1,181 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers.  PC port, SIMD voice mixer.
+ * (C) 2021 Luciano Martorella
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "synth.h"
+#include <string.h>
+
+#ifdef VOICE_MIX_SIMD
+#include <immintrin.h>
+
+/*! Voice lanes, padded to a full AVX2 register of 16-bit lanes */
+#define VOICE_LANES (((VOICE_COUNT) + 15) & ~15)
+
+/*!
+ * Structure-of-arrays copy of the voice state, used between two envelope events.
+ * Samples are kept in the upper byte of the 16-bit lane, so the negation
+ * wraps exactly as the 8-bit `int_sample` does.
+ */
+struct voice_simd_t {
+	/*! `int_sample << 8` */
+	int16_t sample[VOICE_LANES];
+	uint16_t period_remain[VOICE_LANES];
+	uint16_t period[VOICE_LANES];
+	/*! Gain as multiplier: `256 >> gain`, 0 when muted */
+	int16_t gain_mul[VOICE_LANES];
+	/*! -1 when the waveform generator runs (not muted and not a pause) */
+	int16_t active[VOICE_LANES];
+} __attribute__((aligned(32)));
+
+static void voice_simd_load(struct voice_simd_t* soa, struct voice_ch_t* voices, uint8_t voice_count) {
+	memset(soa, 0, sizeof(struct voice_simd_t));
+	for (uint8_t i = 0; i < voice_count; i++, voices++) {
+		uint8_t gain = voices->adsr.gain;
+		soa->sample[i] = (int16_t)(voices->wf.int_sample * 256);
+		soa->period_remain[i] = voices->wf.period_remain;
+		soa->period[i] = voices->wf.period;
+#ifdef WAVEFORM_TYPES
+		if (voices->wf.type != WF_SQUARE) {
+			// Not in the kernel: the lane is left unchanged, and muted
+			continue;
+		}
+#endif
+		soa->gain_mul[i] = gain < 6 ? (256 >> gain) : 0;
+		soa->active[i] = (gain < 6 && voices->wf.period > 0) ? -1 : 0;
+	}
+}
+
+#ifdef WAVEFORM_TYPES
+/*! Mix the voices of the other generators with the scalar renderer */
+static void voice_render_types(struct voice_ch_t* voices, uint8_t voice_count, int16_t* mix, uint16_t count) {
+	for (uint8_t i = voice_count; i; i--, voices++) {
+		if (voices->wf.type != WF_SQUARE && voices->adsr.gain < 6) {
+			voice_wf_render(&voices->wf, mix, count, voices->adsr.gain);
+		}
+	}
+}
+#endif
+
+static void voice_simd_store(struct voice_simd_t* soa, struct voice_ch_t* voices, uint8_t voice_count, uint16_t elapsed) {
+	for (uint8_t i = 0; i < voice_count; i++, voices++) {
+		voices->wf.int_sample = (int8_t)(soa->sample[i] >> 8);
+		voices->wf.period_remain = soa->period_remain[i];
+		voices->adsr.next_event -= elapsed;
+	}
+}
+
+/*! SSE2 kernel: 8 voices per instruction */
+static void voice_simd_kernel_sse2(struct voice_simd_t* soa, int16_t* mix, uint16_t count) {
+	const __m128i step = _mm_set1_epi16(1 << 4);
+	const __m128i zero = _mm_setzero_si128();
+	for (; count; count--) {
+		__m128i acc = zero;
+		for (int i = 0; i < VOICE_LANES; i += 8) {
+			__m128i sample = _mm_load_si128((__m128i*)&soa->sample[i]);
+			__m128i remain = _mm_load_si128((__m128i*)&soa->period_remain[i]);
+			__m128i active = _mm_load_si128((__m128i*)&soa->active[i]);
+
+			// Swap the value when the integer part of `period_remain` is zero
+			__m128i swap = _mm_and_si128(_mm_cmpeq_epi16(_mm_srli_epi16(remain, 4), zero), active);
+			sample = _mm_sub_epi16(_mm_xor_si128(sample, swap), swap);
+			remain = _mm_add_epi16(remain, _mm_and_si128(_mm_load_si128((__m128i*)&soa->period[i]), swap));
+			remain = _mm_sub_epi16(remain, _mm_and_si128(step, active));
+
+			_mm_store_si128((__m128i*)&soa->sample[i], sample);
+			_mm_store_si128((__m128i*)&soa->period_remain[i], remain);
+
+			// (sample << 8) * (256 >> gain) >> 16 == sample >> gain
+			acc = _mm_add_epi16(acc, _mm_mulhi_epi16(sample, _mm_load_si128((__m128i*)&soa->gain_mul[i])));
+		}
+		acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+		acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 4));
+		acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 2));
+		*(mix++) += (int16_t)_mm_cvtsi128_si32(acc);
+	}
+}
+
+/*! AVX2 kernel: 16 voices per instruction */
+__attribute__((target("avx2")))
+static void voice_simd_kernel_avx2(struct voice_simd_t* soa, int16_t* mix, uint16_t count) {
+	const __m256i step = _mm256_set1_epi16(1 << 4);
+	const __m256i zero = _mm256_setzero_si256();
+	for (; count; count--) {
+		__m256i acc = zero;
+		for (int i = 0; i < VOICE_LANES; i += 16) {
+			__m256i sample = _mm256_load_si256((__m256i*)&soa->sample[i]);
+			__m256i remain = _mm256_load_si256((__m256i*)&soa->period_remain[i]);
+			__m256i active = _mm256_load_si256((__m256i*)&soa->active[i]);
+
+			__m256i swap = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_srli_epi16(remain, 4), zero), active);
+			sample = _mm256_sub_epi16(_mm256_xor_si256(sample, swap), swap);
+			remain = _mm256_add_epi16(remain, _mm256_and_si256(_mm256_load_si256((__m256i*)&soa->period[i]), swap));
+			remain = _mm256_sub_epi16(remain, _mm256_and_si256(step, active));
+
+			_mm256_store_si256((__m256i*)&soa->sample[i], sample);
+			_mm256_store_si256((__m256i*)&soa->period_remain[i], remain);
+
+			acc = _mm256_add_epi16(acc, _mm256_mulhi_epi16(sample, _mm256_load_si256((__m256i*)&soa->gain_mul[i])));
+		}
+		__m128i acc128 = _mm_add_epi16(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		acc128 = _mm_add_epi16(acc128, _mm_srli_si128(acc128, 8));
+		acc128 = _mm_add_epi16(acc128, _mm_srli_si128(acc128, 4));
+		acc128 = _mm_add_epi16(acc128, _mm_srli_si128(acc128, 2));
+		*(mix++) += (int16_t)_mm_cvtsi128_si32(acc128);
+	}
+}
+
+void voice_mix_simd(SEQ_CTX_PARAM_ struct voice_ch_t* voices, uint8_t voice_count, int16_t* mix, uint16_t count) {
+	int use_avx2 = __builtin_cpu_supports("avx2");
+	struct voice_simd_t soa;
+
+	while (count) {
+		// Samples before the next envelope event of any voice
+		TIME_SCALE_T run = count;
+		struct voice_ch_t* voice = voices;
+		for (uint8_t i = voice_count; i; i--, voice++) {
+			if (voice->adsr.next_event < run) {
+				run = voice->adsr.next_event;
+			}
+		}
+
+		if (run) {
+			voice_simd_load(&soa, voices, voice_count);
+			if (use_avx2) {
+				voice_simd_kernel_avx2(&soa, mix, run);
+			} else {
+				voice_simd_kernel_sse2(&soa, mix, run);
+			}
+			voice_simd_store(&soa, voices, voice_count, run);
+#ifdef WAVEFORM_TYPES
+			voice_render_types(voices, voice_count, mix, run);
+#endif
+			mix += run;
+			count -= run;
+		} else {
+			// Envelope event: use the scalar path for a single sample
+			SEQ_CTX cur_voice = voices;
+			for (uint8_t i = voice_count; i; i--, SEQ_CTX cur_voice++) {
+				*mix += voice_ch_next(SEQ_CTX_ARG);
+			}
+			mix++;
+			count--;
+		}
+	}
+}
+#endif
@@ -18,10 +18,65 @@
     
 struct poly_synth_t synth;
 
+#ifdef TUNE_DECODE_UNROLLED
+// Generated in tune_gen.c, with a decoder for every bit phase of the frames
+#define frame_decode tune_frame_decode
+#else
 static const uint8_t* tune_ptr;
 static const uint8_t* tune_ptr_end;
 static uint8_t tune_ptr_bits;
 
+#ifdef TUNE_HUFFMAN
+static uint8_t tune_mask;
+
+// Read a single bit, as 0 or 1
+static uint8_t read_bit() {
+    uint8_t bit = (*tune_ptr & tune_mask) ? 1 : 0;
+    tune_mask <<= 1;
+    if (!tune_mask) {
+        tune_mask = 1;
+        tune_ptr++;
+    }
+    return bit;
+}
+
+// Decode a canonical Huffman code, a bit at a time. `codes` is the count of codes of each length.
+// Multiply-free, and 8-bit only (codes are at most 8 bits long)
+static uint8_t read_code(const uint8_t* codes, uint8_t bits) {
+    uint8_t code = 0;
+    uint8_t first = 0;
+    uint8_t index = 0;
+    for (; bits; bits--) {
+        code |= read_bit();
+        uint8_t count = *(codes++);
+        if ((uint8_t)(code - first) < count) {
+            return index + (uint8_t)(code - first);
+        }
+        index += count;
+        first = (uint8_t)(first + count) << 1;
+        code <<= 1;
+    }
+    return 0;
+}
+
+#ifdef TUNE_BACKREF
+// Read a raw value, LSB first
+static uint8_t read_raw(uint8_t bits) {
+    uint8_t value = 0;
+    uint8_t mask = 1;
+    for (; bits; bits--) {
+        if (read_bit()) {
+            value |= mask;
+        }
+        mask <<= 1;
+    }
+    return value;
+}
+#endif
+
+#define READ_REF(codes, bits) read_code(codes, bits)
+#define TUNE_BIT_STATE tune_mask
+#else
 // Return it unmasked
 static uint8_t read_bits(uint8_t bits) {
     uint16_t buffer = *tune_ptr + (uint16_t)(*(tune_ptr + 1) << 8);
@@ -34,21 +89,101 @@ static uint8_t read_bits(uint8_t bits) {
     return (uint8_t)buffer;
 }
 
-// Slow
-void new_frame_require() {
+#define READ_REF(codes, bits) (read_bits(bits) & ((1 << (bits)) - 1))
+#define read_raw(bits) (read_bits(bits) & ((1 << (bits)) - 1))
+#define TUNE_BIT_STATE tune_ptr_bits
+#endif
+
+#ifdef TUNE_TUPLES
+// A single ref per frame, read as the time scale one: the same row of all the tables
+#define BITS_ADSR_TIME_SCALE BITS_FRAME
+#define BITS_WF_PERIOD BITS_FRAME
+#define BITS_WF_AMPLITUDE BITS_FRAME
+#define BITS_ADSR_RELEASE_START BITS_FRAME
+#ifdef WAVEFORM_TYPES
+#define BITS_WF_TYPE BITS_FRAME
+#endif
+#ifdef WAVEFORM_RAMPS
+#define BITS_WF_STEP BITS_FRAME
+#endif
+#define tune_adsr_time_scale_codes tune_frame_codes
+#endif
+
+#ifdef TUNE_BACKREF
+// Frames left in the back-referenced run, and the position to return to
+static uint8_t backref_count;
+static const uint8_t* backref_ptr;
+static uint8_t backref_bits;
+#endif
+
+// Slow: decode the next frame in seq_buf_frame
+static void frame_decode() {
 #if BITS_ADSR_TIME_SCALE > 0
-	uint8_t ref_adsr_time_scale = read_bits(BITS_ADSR_TIME_SCALE) & ((1 << BITS_ADSR_TIME_SCALE) - 1);
+	uint8_t ref_adsr_time_scale = READ_REF(tune_adsr_time_scale_codes, BITS_ADSR_TIME_SCALE);
+#endif
+#ifdef TUNE_BACKREF
+	if (ref_adsr_time_scale == TUNE_ESCAPE_REF) {
+		uint8_t length = read_raw(TUNE_BACKREF_LENGTH_BITS);
+		if (!length) {
+			// End of stream
+			seq_buf_frame.adsr_time_scale_1 = 0;
+			return;
+		}
+		uint8_t bit = read_raw(3);
+#if TUNE_BACKREF_OFFSET_BITS > 8
+		uint16_t offset = read_raw(8);
+		offset |= (uint16_t)read_raw(TUNE_BACKREF_OFFSET_BITS - 8) << 8;
+#else
+		uint8_t offset = read_raw(TUNE_BACKREF_OFFSET_BITS);
+#endif
+		// Jump to the run, and play it
+		backref_count = length;
+		backref_ptr = tune_ptr;
+		backref_bits = TUNE_BIT_STATE;
+		tune_ptr = tune_data + offset;
+#ifdef TUNE_HUFFMAN
+		tune_mask = 1;
+		for (; bit; bit--) {
+			tune_mask <<= 1;
+		}
+#else
+		tune_ptr_bits = bit;
 #endif
+		ref_adsr_time_scale = READ_REF(tune_adsr_time_scale_codes, BITS_ADSR_TIME_SCALE);
+	}
+#endif
+#ifdef TUNE_TUPLES
+	uint8_t ref_wf_period = ref_adsr_time_scale;
+	uint8_t ref_wf_amplitude = ref_adsr_time_scale;
+	uint8_t ref_adsr_release_start = ref_adsr_time_scale;
+#ifdef WAVEFORM_TYPES
+	uint8_t ref_wf_type = ref_adsr_time_scale;
+#endif
+#ifdef WAVEFORM_RAMPS
+	uint8_t ref_wf_step = ref_adsr_time_scale;
+#endif
+#else
 #if BITS_WF_PERIOD > 0
-	uint8_t ref_wf_period = read_bits(BITS_WF_PERIOD) & ((1 << BITS_WF_PERIOD) - 1);
+	uint8_t ref_wf_period = READ_REF(tune_wf_period_codes, BITS_WF_PERIOD);
 #endif
 #if BITS_WF_AMPLITUDE > 0
-	uint8_t ref_wf_amplitude = read_bits(BITS_WF_AMPLITUDE) & ((1 << BITS_WF_AMPLITUDE) - 1);
+	uint8_t ref_wf_amplitude = READ_REF(tune_wf_amplitude_codes, BITS_WF_AMPLITUDE);
 #endif
 #if BITS_ADSR_RELEASE_START > 0
-	uint8_t ref_adsr_release_start = read_bits(BITS_ADSR_RELEASE_START) & ((1 << BITS_ADSR_RELEASE_START) - 1);
+	uint8_t ref_adsr_release_start = READ_REF(tune_adsr_release_start_codes, BITS_ADSR_RELEASE_START);
+#endif
+#if defined(WAVEFORM_TYPES) && BITS_WF_TYPE > 0
+	uint8_t ref_wf_type = READ_REF(tune_wf_type_codes, BITS_WF_TYPE);
+#endif
+#if defined(WAVEFORM_RAMPS) && BITS_WF_STEP > 0
+	uint8_t ref_wf_step = READ_REF(tune_wf_step_codes, BITS_WF_STEP);
+#endif
 #endif
 
+#ifdef TUNE_END_FRAME
+	// The stream ends with an explicit frame, no need to check the pointer
+	{
+#else
 	if (tune_ptr >= (tune_ptr_end - 1)
 #if BITS_ADSR_TIME_SCALE > 0
             && !ref_adsr_time_scale
@@ -61,10 +196,17 @@ void new_frame_require() {
 #endif
 #if BITS_ADSR_RELEASE_START > 0
             && !ref_adsr_release_start
+#endif
+#if defined(WAVEFORM_TYPES) && BITS_WF_TYPE > 0
+            && !ref_wf_type
+#endif
+#if defined(WAVEFORM_RAMPS) && BITS_WF_STEP > 0
+            && !ref_wf_step
 #endif
             ) {
 		seq_buf_frame.adsr_time_scale_1 = 0;
 	} else {
+#endif
 #if BITS_ADSR_TIME_SCALE > 0
 		seq_buf_frame.adsr_time_scale_1 = tune_adsr_time_scale_refs[ref_adsr_time_scale];
 #else
@@ -84,9 +226,61 @@ void new_frame_require() {
 		seq_buf_frame.adsr_release_start = tune_adsr_release_start_refs[ref_adsr_release_start];
 #else
 		seq_buf_frame.adsr_release_start = tune_adsr_release_start_refs[0];
+#endif
+#ifdef WAVEFORM_TYPES
+#if BITS_WF_TYPE > 0
+		seq_buf_frame.wf_type = tune_wf_type_refs[ref_wf_type];
+#else
+		seq_buf_frame.wf_type = tune_wf_type_refs[0];
+#endif
+#endif
+#ifdef WAVEFORM_RAMPS
+		// The ramp step is precomputed by the compiler: no division when the frame is fed
+#if BITS_WF_STEP > 0
+		seq_buf_frame.wf_step = tune_wf_step_refs[ref_wf_step];
+#else
+		seq_buf_frame.wf_step = tune_wf_step_refs[0];
+#endif
 #endif
 	}
+
+#ifdef TUNE_BACKREF
+	if (backref_count && !--backref_count) {
+		// End of the run
+		tune_ptr = backref_ptr;
+		TUNE_BIT_STATE = backref_bits;
+	}
+#endif
+}
+#endif
+
+// The next frame is already in seq_buf_frame, decoded during the idle wait of the previous sample
+static uint8_t frame_ready;
+
+void new_frame_require() {
+	if (!frame_ready) {
+		frame_decode();
+	}
+	frame_ready = 0;
+}
+
+#ifdef SAMPLE_RING_SIZE
+// Samples rendered ahead, written to the PWM by the timer interrupt
+static volatile uint8_t sample_ring[SAMPLE_RING_SIZE];
+static volatile uint8_t ring_head;
+static volatile uint8_t ring_tail;
+
+void __interrupt() sample_isr() {
+    if (INTCONbits.T0IF) {
+        INTCONbits.T0IF = 0;
+        // On underrun the previous sample is held
+        if (ring_head != ring_tail) {
+            CCPR1L = sample_ring[ring_head & (SAMPLE_RING_SIZE - 1)];
+            ring_head++;
+        }
+    }
 }
+#endif
 
 void main() {
     while (1) {
@@ -120,10 +314,28 @@ void main() {
         TRISIObits.TRISIO2 = 0;
         CCP1CONbits.DC1B = 0;
 
+#ifdef SAMPLE_RING_SIZE
+        ring_head = ring_tail = 0;
+        INTCONbits.T0IF = 0;
+        INTCONbits.T0IE = 1;
+        INTCONbits.GIE = 1;
+#endif
+
         for (uint8_t count = 3; count; count--) {
+#ifdef TUNE_DECODE_UNROLLED
+            tune_decode_reset();
+#else
             tune_ptr = tune_data;
             tune_ptr_end = tune_data + TUNE_DATA_SIZE - 1;
             tune_ptr_bits = 0;
+#endif
+#ifdef TUNE_HUFFMAN
+            tune_mask = 1;
+#endif
+#ifdef TUNE_BACKREF
+            backref_count = 0;
+#endif
+            frame_ready = 0;
             seq_end = 0;
             cur_voice = &synth.voice[0];
             for (uint8_t i = 0; i < VOICE_COUNT; i++, cur_voice++) {
@@ -134,15 +346,41 @@ void main() {
 
             while (!seq_end) {
 
+#ifdef SAMPLE_RING_SIZE
+                // From +128 to -128
+                uint8_t sample = (uint8_t)(seq_feed_synth()) + 128;
+
+                // Wait for a free slot, the interrupt drains the ring
+                while ((uint8_t)(ring_tail - ring_head) == SAMPLE_RING_SIZE);
+                sample_ring[ring_tail & (SAMPLE_RING_SIZE - 1)] = sample;
+                ring_tail++;
+#else
                 // From +128 to -128
                 CCPR1L = (uint8_t)(seq_feed_synth()) + 128;            
+#endif
 
+                // Prefetch the next frame while waiting: at most a frame is consumed per sample,
+                // so seq_feed_synth never runs the decoder. Nothing is left to decode after the end
+                // frame (the fixed-width streams would read past the tune data)
+                if (!frame_ready && !seq_end) {
+                    frame_decode();
+                    frame_ready = 1;
+                }
+
+#ifndef SAMPLE_RING_SIZE
                 // Wait for next sampling op
                 while (!INTCONbits.T0IF);
                 INTCONbits.T0IF = 0;
+#endif
             }
         }
 
+#ifdef SAMPLE_RING_SIZE
+        // Play out the ring
+        while (ring_head != ring_tail);
+        INTCONbits.GIE = 0;
+#endif
+
         // HALT PWM and set 0 to save battery
         CCP1CONbits.CCP1M = 0x0;
         TRISIObits.TRISIO2 = 0;
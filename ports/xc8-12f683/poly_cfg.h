@@ -35,4 +35,12 @@
 
 #define VOICE_COUNT SEQ_CHANNEL_COUNT
 
+/*!
+ * By default the sample loop writes the PWM and busy-waits the timer.
+ * Define SAMPLE_RING_SIZE (a power of two) to write the samples from the Timer0 interrupt
+ * instead, out of a ring rendered ahead by the main loop: the occasional expensive samples
+ * are then absorbed by the ring.
+ */
+// #define SAMPLE_RING_SIZE 4
+
 #endif
@@ -20,57 +20,81 @@
 
 #include "sequencer.h"
 #include "synth.h"
+#include <string.h>
 
 /*! State used between `seq_play_stream` and `seq_feed_synth` */
-#ifndef SEQ_CHANNEL_COUNT
-static uint8_t seq_voice_count;
-#else
+#ifdef SEQ_CHANNEL_COUNT
 #define seq_voice_count SEQ_CHANNEL_COUNT
+#elif !defined(SEQ_REENTRANT)
+static uint8_t seq_voice_count;
 #endif
 
+#ifndef SEQ_REENTRANT
 uint8_t seq_end = 0;
 struct seq_frame_t seq_buf_frame;
 struct voice_ch_t* cur_voice;
+#ifdef CHECK_CLIPPING
+int clip_count = 0;
+#endif
+#else
+void seq_ctx_init(struct seq_ctx_t* ctx, void (*new_frame_require)(struct seq_ctx_t* ctx), void* frame_source) {
+	memset(ctx, 0, sizeof(struct seq_ctx_t));
+	ctx->new_frame_require = new_frame_require;
+	ctx->frame_source = frame_source;
+}
+#endif
 
-void seq_play_stream(uint8_t voices) {
+void seq_play_stream(SEQ_CTX_PARAM_ uint8_t voices) {
 #ifndef SEQ_CHANNEL_COUNT
-	seq_voice_count = voices;
+	SEQ_CTX seq_voice_count = voices;
 #endif
 
 	// Disable all channels
-    seq_end = 0;
+    SEQ_CTX seq_end = 0;
 }
 
-int8_t seq_feed_synth() {
+#ifndef SEQ_FEED_UNROLLED
+// Otherwise generated in tune_gen.c, for the voices and features of the tune
+int8_t seq_feed_synth(SEQ_CTX_PARAM) {
 #ifndef NO_CLIP_CHECK
 	int16_t sample = 0;
 #else
 	int8_t sample = 0;
 #endif
 
-    cur_voice = &synth.voice[0];
+    SEQ_CTX cur_voice = &SEQ_CTX synth.voice[0];
     uint8_t fed = 0;
-    uint8_t i = seq_voice_count;
+    uint8_t i = SEQ_CTX seq_voice_count;
 	do {
-		sample += voice_ch_next();
-        if (!fed && cur_voice->adsr.state_counter == ADSR_STATE_END) {
+		sample += voice_ch_next(SEQ_CTX_ARG);
+        if (!fed && SEQ_CTX cur_voice->adsr.state_counter == ADSR_STATE_END) {
             // Feed data
+#ifdef SEQ_REENTRANT
+			ctx->new_frame_require(ctx);
+#else
 			new_frame_require();
-            if (seq_buf_frame.adsr_time_scale_1 == 0) {
+#endif
+            if (SEQ_CTX seq_buf_frame.adsr_time_scale_1 == 0) {
                 // End-of-stream
-				seq_end = 1;
+				SEQ_CTX seq_end = 1;
                 break;
             }
 
-            voice_wf_set(&seq_buf_frame);
-            adsr_config(&seq_buf_frame);
+            voice_wf_set(SEQ_CTX_ARG_ &SEQ_CTX seq_buf_frame);
+            adsr_config(SEQ_CTX_ARG_ &SEQ_CTX seq_buf_frame);
 
 			// Don't overload the CPU with multiple frames per sample
 			// This will create minimum phase errors (of 1 sample period) but will keep the process real-time on slower CPUs
             fed = 1;
 		}
+#ifdef SEQ_FEED_COMPENSATE
+		else if (SEQ_FEED_COMPENSATE_ON && SEQ_CTX cur_voice->adsr.state_counter == ADSR_STATE_END && SEQ_CTX cur_voice->adsr.late < UINT8_MAX) {
+			// Waiting for the next sample: the envelope will be shortened by the delay
+			SEQ_CTX cur_voice->adsr.late++;
+		}
+#endif
         i--;
-        cur_voice++;
+        SEQ_CTX cur_voice++;
 	} while (i);
 
 	/* Handle clipping */
@@ -78,14 +102,111 @@ int8_t seq_feed_synth() {
 	if (sample > INT8_MAX) {
 		sample = INT8_MAX;
 #ifdef CHECK_CLIPPING
-		clip_count++;
+		SEQ_CTX clip_count++;
 #endif
 	} else if (sample < INT8_MIN) {
 		sample = INT8_MIN;
 #ifdef CHECK_CLIPPING
-		clip_count++;
+		SEQ_CTX clip_count++;
 #endif
 	}
 #endif
 	return sample;
 }
+#endif
+
+#ifdef SEQ_BLOCK_SIZE
+/*! Number of samples before the voice envelope reaches `ADSR_STATE_END`, the ending sample excluded */
+static uint32_t seq_voice_span(const struct voice_ch_t* voice) {
+	return voice->adsr.next_event + (uint32_t)(ADSR_TIME_UNITS + 1 - voice->adsr.state_counter) * (voice->adsr.def.time_scale + 1);
+}
+
+#ifndef VOICE_MIX_SIMD
+/*! Mix `count` samples of a voice that won't reach the envelope end in the meantime */
+static void seq_voice_render(SEQ_CTX_PARAM_ struct voice_ch_t* voice, int16_t* mix, uint16_t count) {
+	while (count) {
+		TIME_SCALE_T run = voice->adsr.next_event;
+		if (run) {
+			// Constant gain until the next envelope event
+			if (run > count) {
+				run = count;
+			}
+			voice->adsr.next_event -= run;
+			if (voice->adsr.gain < 6) {
+				voice_wf_render(&voice->wf, mix, run, voice->adsr.gain);
+			}
+			mix += run;
+			count -= run;
+		} else {
+			// Envelope event
+			SEQ_CTX cur_voice = voice;
+			*(mix++) += voice_ch_next(SEQ_CTX_ARG);
+			count--;
+		}
+	}
+}
+#endif
+
+size_t seq_render_block(SEQ_CTX_PARAM_ int8_t* out, size_t count) {
+	int16_t mix[SEQ_BLOCK_SIZE];
+	size_t pos = 0;
+
+	while (pos < count && !SEQ_CTX seq_end) {
+		// Find the next sample that requires a frame feed
+		uint32_t span = UINT32_MAX;
+		struct voice_ch_t* voice = &SEQ_CTX synth.voice[0];
+		for (uint8_t i = SEQ_CTX seq_voice_count; i; i--, voice++) {
+			if (voice->adsr.state_counter == ADSR_STATE_END) {
+				span = 0;
+				break;
+			}
+			uint32_t voice_span = seq_voice_span(voice);
+			if (voice_span < span) {
+				span = voice_span;
+			}
+		}
+
+		if (!span) {
+			// Feed frames using the per-sample path
+			out[pos++] = seq_feed_synth(SEQ_CTX_ARG);
+			continue;
+		}
+
+		if (span > count - pos) {
+			span = count - pos;
+		}
+		if (span > SEQ_BLOCK_SIZE) {
+			span = SEQ_BLOCK_SIZE;
+		}
+
+		memset(mix, 0, sizeof(int16_t) * span);
+#ifdef VOICE_MIX_SIMD
+		voice_mix_simd(SEQ_CTX_ARG_ &SEQ_CTX synth.voice[0], SEQ_CTX seq_voice_count, mix, (uint16_t)span);
+#else
+		voice = &SEQ_CTX synth.voice[0];
+		for (uint8_t i = SEQ_CTX seq_voice_count; i; i--, voice++) {
+			seq_voice_render(SEQ_CTX_ARG_ voice, mix, (uint16_t)span);
+		}
+#endif
+
+		for (uint16_t i = 0; i < span; i++) {
+			int16_t sample = mix[i];
+#ifndef NO_CLIP_CHECK
+			if (sample > INT8_MAX) {
+				sample = INT8_MAX;
+#ifdef CHECK_CLIPPING
+				SEQ_CTX clip_count++;
+#endif
+			} else if (sample < INT8_MIN) {
+				sample = INT8_MIN;
+#ifdef CHECK_CLIPPING
+				SEQ_CTX clip_count++;
+#endif
+			}
+#endif
+			out[pos++] = (int8_t)sample;
+		}
+	}
+	return pos;
+}
+#endif
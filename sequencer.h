@@ -21,6 +21,46 @@
 #define _SEQUENCER_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "poly_cfg.h"
+
+/*
+ * Engine state. By default the synth and sequencer state is kept in global variables,
+ * the fastest option for the MCU. If `SEQ_REENTRANT` is defined in `poly_cfg.h`, the state
+ * is kept in a `struct seq_ctx_t` context, passed as first argument to the engine functions,
+ * so independent tunes can be played concurrently.
+ */
+#ifdef SEQ_REENTRANT
+struct seq_ctx_t;
+/*! Context parameter declaration, alone or followed by other parameters */
+#define SEQ_CTX_PARAM	struct seq_ctx_t* ctx
+#define SEQ_CTX_PARAM_	struct seq_ctx_t* ctx,
+/*! Context argument, alone or followed by other arguments */
+#define SEQ_CTX_ARG		ctx
+#define SEQ_CTX_ARG_	ctx,
+/*! Prefix to access the engine state */
+#define SEQ_CTX			ctx->
+#else
+#define SEQ_CTX_PARAM	void
+#define SEQ_CTX_PARAM_
+#define SEQ_CTX_ARG
+#define SEQ_CTX_ARG_
+#define SEQ_CTX
+#endif
+
+/*!
+ * Waveform generators other than the square wave, compiled in only if defined in `poly_cfg.h`
+ * (or in `tune_gen.h`, when the tune uses them): `WAVEFORM_SAWTOOTH`, `WAVEFORM_TRIANGLE`, `WAVEFORM_NOISE`.
+ */
+#if defined(WAVEFORM_SAWTOOTH) || defined(WAVEFORM_TRIANGLE) || defined(WAVEFORM_NOISE)
+#define WAVEFORM_TYPES
+#endif
+
+/*! Generators with a per-sample ramp */
+#if defined(WAVEFORM_SAWTOOTH) || defined(WAVEFORM_TRIANGLE)
+#define WAVEFORM_RAMPS
+#endif
 
 /*! 
  * Define a single step/frame of the sequencer. It applies to the active channel.
@@ -33,8 +73,16 @@ struct seq_frame_t {
     uint16_t wf_period;
     /*! Waveform amplitude */
     int8_t wf_amplitude;
-    /*! When the release period starts, time units over the ADSR_TIME_UNITS scale */
+    /*! When the release period starts, time units over the ADSR_TIME_UNITS scale. With ADSR_TABLE, the upper bits are the ADSR_SHAPE_* */
     uint8_t adsr_release_start;
+#ifdef WAVEFORM_TYPES
+    /*! Waveform generator, WF_* */
+    uint8_t wf_type;
+#endif
+#ifdef WAVEFORM_RAMPS
+    /*! Sawtooth and triangle: ramp increment per sample (8.8 fixed point), computed by the compiler */
+    int16_t wf_step;
+#endif
 };
 
 /*! 
@@ -42,22 +90,36 @@ struct seq_frame_t {
  * The frames must then be sorted in the same fetch order and not in channel order.
  * Frames will be fed using the handler passed by `new_frame_require`.
  */
-void seq_play_stream(uint8_t voices);
+void seq_play_stream(SEQ_CTX_PARAM_ uint8_t voices);
 
+#ifndef SEQ_REENTRANT
 /*! Requires a new frame. The call never fails. Returns a zero frame at the end of the stream, or if EOF */
 extern struct seq_frame_t seq_buf_frame;
 
 /*! Set at the stream end */
 extern uint8_t seq_end;
 
-/*! Requires a new frame to be written in `seq_buf_frame`. The call never fails. */
-void new_frame_require();
+/*! 
+ * Requires a new frame to be written in `seq_buf_frame`. The call never fails. 
+ * Implemented by the port (or set in the context, for reentrant builds).
+ */
+void new_frame_require(void);
+#endif
 
 /*!
  * Use it when `seq_play_stream` is in use, must be called at every sample 
  * It call `poly_synth_next` internally.
 */
-int8_t seq_feed_synth();
+int8_t seq_feed_synth(SEQ_CTX_PARAM);
+
+/*!
+ * Block version of `seq_feed_synth`, bit-exact with it. Renders up to `count` samples
+ * in `out`, and returns the number of samples written (less than `count` only at the stream end).
+ * Available when `SEQ_BLOCK_SIZE` (the size of the mixing buffer) is defined in `poly_cfg.h`.
+ * Voices are rendered in tight loops between envelope events, and the per-sample path
+ * is used only on the samples that require a frame feed.
+ */
+size_t seq_render_block(SEQ_CTX_PARAM_ int8_t* out, size_t count);
 
 /*! List of frames, used by `seq_frame_map_t` */
 struct seq_frame_list_t {
@@ -79,29 +141,248 @@ struct seq_frame_map_t {
 	struct seq_frame_list_t* channels;
 }; 
 
-/*! Compile/reorder a frame-map (by channel) to a sequential stream */
-void seq_compile(struct seq_frame_map_t* map, struct seq_frame_t** frame_stream, int* frame_count, int* voice_count, int* do_clip_check);
+/*!
+ * Compile option: the player compensates the late frame feeds (`SEQ_FEED_COMPENSATE`).
+ * Shares the bits of the STREAM_* options.
+ */
+#define SEQ_COMPILE_COMPENSATE 16
+
+/*!
+ * Codegen option: emit a `seq_feed_synth` specialized for the tune (`SEQ_FEED_UNROLLED`),
+ * and the frame decoder of the bit phases of fixed-width streams (`TUNE_DECODE_UNROLLED`).
+ * Shares the bits of the STREAM_* options.
+ */
+#define SEQ_CODEGEN_UNROLL 32
+
+/*!
+ * Cycle cost model of the target MCU, used by `seq_compile` to profile the per-sample work (if requested).
+ */
+struct seq_cost_model_t {
+	/*! Cycles available per sample: the instruction rate over the sample rate */
+	int budget;
+	/*! Samples buffered by the output (the interrupt ring): overruns are absorbed over this window */
+	int window;
+	/*! Cycles of the fixed work of a sample */
+	int sample;
+	/*! Cycles of each voice (envelope step) */
+	int voice;
+	/*! Cycles of each audible voice (waveform step and mix) */
+	int active;
+	/*! Cycles of a single gain shift (`>>= gain` loops on the PIC) */
+	int shift;
+	/*! Cycles of a frame decode and feed */
+	int frame;
+	/*! Cycles of the clipping check, when the tune requires it */
+	int clip;
+};
+
+/*! Rough model of the PIC12F683 at 20MHz (5 MIPS), with the SYNTH_FREQ of the port and the opt-in ring of 4 samples
+ * (`SAMPLE_RING_SIZE`): use a window of 1 with `--cost` to profile the busy-wait loop */
+#define SEQ_COST_MODEL_PIC12F683 { 5000000 / (4883 * 2), 4, 40, 30, 25, 3, 250, 12 }
+
+/*! Occupancy of a voice in the playback simulation, in samples */
+struct seq_voice_stats_t {
+	/*! Samples with a running envelope (busy), the others are idle */
+	uint32_t busy;
+	/*! Busy samples muted by the envelope (`gain >= 6`) */
+	uint32_t muted;
+	/*! Busy samples of rests (`wf_period == 0`) */
+	uint32_t rest;
+};
+
+/*! Run of consecutive clipped samples */
+struct seq_clip_run_t {
+	uint32_t start;
+	uint32_t length;
+};
+
+/*!
+ * Polyphony statistics of the playback simulation of `seq_compile`.
+ * Empty (`sample_count` zero) if the tune can't be simulated.
+ */
+struct seq_stats_t {
+	/*! Samples of the tune */
+	uint32_t sample_count;
+	/*! Voices of the tune, the size of `voices` */
+	int voice_count;
+	struct seq_voice_stats_t* voices;
+	/*!
+	 * Samples by count of simultaneous voices (`voice_count + 1` entries): busy voices,
+	 * and audible voices (busy, not muted and not on a rest)
+	 */
+	uint32_t* busy_histogram;
+	uint32_t* audible_histogram;
+	/*! Clipped samples, by time position */
+	int clip_run_count;
+	struct seq_clip_run_t* clip_runs;
+};
+
+/*!
+ * Compile/reorder a frame-map (by channel) to a sequential stream, for a player
+ * using the SEQ_COMPILE_* `options`. Reports the start latency and the phase error of the voices
+ * to `log` (silent if NULL), and the per-sample cost profile over the `cost` model if not NULL.
+ * If `stats` is not NULL, it receives the polyphony statistics (to free with `seq_stats_free`).
+ */
+void seq_compile(struct seq_frame_map_t* map, int options, const struct seq_cost_model_t* cost, struct seq_stats_t* stats, FILE* log, struct seq_frame_t** frame_stream, int* frame_count, int* voice_count, int* do_clip_check);
+
+/*! Tolerances of `seq_quantize` */
+struct seq_quantize_t {
+	/*! Pitch tolerance of the merged periods, in cents */
+	double cents;
+	/*! Timing tolerance of the merged time scales, in samples */
+	int samples;
+};
+
+/*!
+ * Merge the near-duplicate periods and time scales of the frame map (by channel), to shrink the ref tables:
+ * the less frequent values are replaced by the more frequent ones within the `tolerance`.
+ * The timing error of a voice is carried to its next notes, so that the channels don't drift.
+ * Prints the values and the ref bits saved per field to `log` (silent if NULL).
+ */
+void seq_quantize(struct seq_frame_map_t* map, const struct seq_quantize_t* tolerance, FILE* log);
 
 /*! Free the stream allocated by `seq_compile`. */
 void seq_free(struct seq_frame_t* seq_frame_stream);
 
+/*! Free the statistics allocated by `seq_compile`. */
+void seq_stats_free(struct seq_stats_t* stats);
+
 struct ref_map_t {
     int count;
     int* values;
+    /*! Bits per ref, or the longest code length in Huffman mode */
     int bit_count;
+    /*! Huffman mode: count of codes of each length, from 1 to `bit_count`. Refs are in canonical order */
+    uint8_t* code_counts;
+    /*! Bits used by the refs in the stream */
+    int total_bits;
 };
 
+/*! Stream option: refs are coded with canonical Huffman codes, instead of fixed-size indices */
+#define STREAM_HUFFMAN 1
+
+/*! Longest Huffman code, so the decoders can use 8-bit arithmetic */
+#define STREAM_HUFFMAN_MAX_BITS 8
+
+/*! Stream option: repeated runs of frames are coded as back-references to their first occurrence */
+#define STREAM_BACKREF 2
+
+/*! Size of the back-reference run length, in frames */
+#define STREAM_BACKREF_LENGTH_BITS 8
+#define STREAM_BACKREF_MAX_LENGTH ((1 << STREAM_BACKREF_LENGTH_BITS) - 1)
+
+/*!
+ * Stream option: frames are coded with a single ref, in the table of the distinct frames (tuples).
+ * The field ref maps are then the columns of the table.
+ */
+#define STREAM_TUPLES 4
+
+/*! Stream option: always code the field refs separately. By default, the smaller layout between fields and tuples is used */
+#define STREAM_FIELDS 8
+
+/*! Stream option: fixed-size refs are padded to 4 or 8 bits, so that the fields start at nibble boundaries (not with Huffman codes) */
+#define STREAM_ALIGN_NIBBLE 64
+
+/*! Stream option: fixed-size refs are padded to 8 bits, so that the fields are bytes (not with Huffman codes) */
+#define STREAM_ALIGN_BYTE 128
+
+/*!
+ * Options that end the stream with an explicit frame, instead of the zero-filled tail.
+ * The aligned frames can span more bytes than the end check of the tail expects.
+ */
+#define STREAM_END_FRAME (STREAM_HUFFMAN | STREAM_BACKREF | STREAM_TUPLES | STREAM_ALIGN_NIBBLE | STREAM_ALIGN_BYTE)
+
+/*! Frame fields coded in the stream */
+#define STREAM_FIELD_COUNT 6
+
 struct bit_stream_t {
+    /*! STREAM_* options */
+    int options;
     struct ref_map_t refs_adsr_time_scale;
     struct ref_map_t refs_wf_period;
     struct ref_map_t refs_wf_amplitude;
     struct ref_map_t refs_adsr_release_start;
+    struct ref_map_t refs_wf_type;
+    struct ref_map_t refs_wf_step;
+    /*! Tuple layout: the frame refs (the field ref maps are the table columns) */
+    struct ref_map_t refs_frame;
+    /*! Ref of the escape (time scale 0): the end frame, or a back-reference */
+    int escape_ref;
+    /*! Size of the back-reference byte offsets */
+    int backref_offset_bits;
+    /*! Back-references in the stream */
+    int backref_count;
     uint8_t* data;
     int data_size;
 };
 
-/*! Compress the frame stream to bit-stream */
-int stream_compress(struct seq_frame_t* frame_stream, int frame_count, struct bit_stream_t* stream);
+/*!
+ * Compress the frame stream to bit-stream, using the STREAM_* `options`, and print the stream statistics to `log` (silent if NULL).
+ * A forced STREAM_TUPLES layout falls back to the fields one, with a warning, if the tuples don't fit in 8 bit refs.
+ */
+int stream_compress(struct seq_frame_t* frame_stream, int frame_count, int options, FILE* log, struct bit_stream_t* stream);
+
+/*! Compress the frame stream as `stream_compress`, without printing the statistics (only the layout choice, to `log` if not NULL) nor the tuples fallback */
+int stream_pack(struct seq_frame_t* frame_stream, int frame_count, int options, FILE* log, struct bit_stream_t* stream);
+
+/*! Print the ref tables and the size of the stream to `log` */
+void stream_print(const struct bit_stream_t* stream, int frame_count, FILE* log);
+
+/*!
+ * Decoder cost model of the target, to estimate the program memory and the decode time of a stream encoding.
+ * Code sizes are in program words, times in cycles.
+ */
+struct stream_cost_model_t {
+	/*! Code of the fixed-width decoder (`read_bits`), and the additional code of the Huffman and back-reference decoders */
+	int code_fixed;
+	int code_huffman;
+	int code_backref;
+	/*! Code of the phase-unrolled decoder: fixed, and per field of every phase */
+	int code_unrolled;
+	int code_unrolled_field;
+	/*! Code of the generic feed loop, and of every voice of the unrolled one */
+	int code_feed;
+	int code_feed_voice;
+	/*! Fixed cycles of a frame decode, and of a table lookup (a byte) */
+	int frame;
+	int lookup;
+	/*! Cycles of a `read_bits` field, plus every bit of the variable shift */
+	int field;
+	int shift_bit;
+	/*! Cycles of a phase-unrolled field, plus its constant shifts */
+	int field_unrolled;
+	/*! Cycles of a Huffman code bit (`read_bit` and the code compare) */
+	int code_bit;
+	/*! Cycles of a back-reference jump (escape, length and position) */
+	int backref;
+};
+
+/*! Rough model of the PIC12F683 decoder, see `ports/xc8-12f683/main.c` */
+#define STREAM_COST_MODEL_PIC12F683 { 70, 60, 70, 20, 12, 40, 30, 40, 10, 30, 6, 8, 25, 300 }
+
+/*! Estimated cost of a stream encoding */
+struct stream_cost_t {
+	/*! Program words of the stream, the ref tables and the decoder */
+	int words;
+	/*! Decode cycles per frame: average, and of the worst frame */
+	double cycles;
+	int worst_cycles;
+};
+
+/*! Estimate the cost of the `stream` of `frame_count` frames, played on `voice_count` voices, over the `model` */
+void stream_cost(const struct bit_stream_t* stream, int frame_count, int voice_count, const struct stream_cost_model_t* model, struct stream_cost_t* cost);
+
+/*! Waveform generators used by the stream, as a mask of `1 << WF_*` */
+int stream_wf_types(const struct bit_stream_t* stream);
+
+/*! Frame fields decoded by the player: the generator and the ramp step only if the stream uses them */
+int stream_field_count(const struct bit_stream_t* stream);
+
+/*!
+ * Rows of the envelope gain table of the stream: the distinct envelopes, or 0 if the stream only
+ * uses the default shape (the branch-based envelope is smaller, so the table is not emitted).
+ */
+int stream_envelope_count(const struct bit_stream_t* stream);
 
 /*! Free the stream */
 void stream_free(struct bit_stream_t* stream);
@@ -25,53 +25,296 @@
 #include <stdlib.h>
 #include <string.h>
 
-int clip_count = 0;
-
-struct compiler_channel_state_t {
-	/*! The positions of every channel in the input channel map */
-	int position;
+#if defined(SEQ_REENTRANT) && defined(CHECK_CLIPPING)
+/*! Frame source of the playback simulation */
+struct compiler_source_t {
+	const struct seq_frame_t* frames;
+	int count;
+	int pos;
 };
 
-/*! State of the sequencer compiler */
-struct compiler_state_t {
-	/*! The input channel map */
-	struct seq_frame_map_t* input_map;
-	/*! The output frame stream */
-	struct seq_frame_t* out_stream;
-	/*! The position of writing frame in the output stream */
-	int stream_position;
-	/*! State of each channel */
-	struct compiler_channel_state_t* channels;
+static void compiler_frame_require(struct seq_ctx_t* ctx) {
+	struct compiler_source_t* source = ctx->frame_source;
+	if (source->pos < source->count) {
+		ctx->seq_buf_frame = source->frames[source->pos++];
+	} else {
+		// End of stream
+		memset(&ctx->seq_buf_frame, 0, sizeof(struct seq_frame_t));
+	}
+}
+
+/*!
+ * Per-sample work of the playback simulation. The costs are accumulated as the samples are played:
+ * only the last `cost->window` samples are kept, so the memory doesn't depend on the tune length.
+ */
+struct seq_profile_t {
+	const struct seq_cost_model_t* cost;
+	/*! Cycles of the clipping check, added to every sample if the tune requires it */
+	int extra;
+	/*! Cycles of the last `cost->window` samples (a ring), and their sum */
+	uint32_t* window_cycles;
+	uint32_t window_sum;
+	uint32_t count;
+	uint64_t total;
+	/*! Worst sample and worst window, and their positions */
+	uint32_t worst;
+	uint32_t worst_at;
+	uint32_t worst_window;
+	uint32_t worst_window_at;
+	/*! Samples over budget, and the histogram in buckets of 10% of the budget (the last one for the overruns) */
+	uint32_t overruns;
+	uint32_t histogram[11];
+	/*! Maximum per sample of the audible voices, of the voices in attack, decay/sustain and release, and of the gain shifts */
+	int max_active;
+	int max_attack;
+	int max_decay;
+	int max_release;
+	int max_shifts;
+	/*! Samples feeding a frame, and clipped samples */
+	uint32_t frame_count;
+	uint32_t clip_count;
 };
 
-/*! Feed the first free channel and copy the selected frame in the output stream */
-static void seq_feed_channels(struct compiler_state_t* state) {
-	cur_voice = &synth.voice[0];
-	int voice_idx = 0;
-
-	for (int map_idx = 0; map_idx < state->input_map->channel_count; map_idx++) {
-		const struct seq_frame_list_t* channel = &state->input_map->channels[map_idx]; 
-		// Skip empty channels
-		if (channel->count > 0) {
-			if (state->channels[voice_idx].position < channel->count && (cur_voice->adsr.state_counter == ADSR_STATE_END)) {
-				// Feed data
-				struct seq_frame_t* frame = &channel->frames[state->channels[voice_idx].position++];
-
-				voice_wf_set(frame);
-				adsr_config(frame);
-
-				state->out_stream[state->stream_position++] = *frame;
-				// Don't overload the CPU with multiple frames per sample
-				// This will create minimum phase errors (of 1 sample period) but will keep the process real-time on slower CPUs
-				break;
+static void seq_profile_init(struct seq_profile_t* profile, const struct seq_cost_model_t* cost, int clip_check) {
+	memset(profile, 0, sizeof(struct seq_profile_t));
+	profile->cost = cost;
+	profile->extra = clip_check ? cost->clip : 0;
+	profile->window_cycles = calloc(cost->window, sizeof(uint32_t));
+}
+
+/*! Add the work of the last sample to the profile */
+static void seq_profile_sample(struct seq_profile_t* profile, struct seq_ctx_t* ctx, int fed, int clipped) {
+	const struct seq_cost_model_t* cost = profile->cost;
+	int active = 0, attack = 0, decay = 0, release = 0, shifts = 0;
+	const struct voice_ch_t* voice = &ctx->synth.voice[0];
+	for (uint8_t i = ctx->seq_voice_count; i; i--, voice++) {
+		if (voice->adsr.state_counter == ADSR_STATE_END) {
+			continue;
+		}
+		if (voice->adsr.state_counter < ADSR_STATE_SUSTAIN_START) {
+			attack++;
+		} else if (voice->adsr.state_counter < (voice->adsr.def.release_start & ADSR_RELEASE_MASK)) {
+			decay++;
+		} else {
+			release++;
+		}
+		if (voice->adsr.gain < 6) {
+			active++;
+			shifts += voice->adsr.gain;
+		}
+	}
+	profile->max_active = active > profile->max_active ? active : profile->max_active;
+	profile->max_attack = attack > profile->max_attack ? attack : profile->max_attack;
+	profile->max_decay = decay > profile->max_decay ? decay : profile->max_decay;
+	profile->max_release = release > profile->max_release ? release : profile->max_release;
+	profile->max_shifts = shifts > profile->max_shifts ? shifts : profile->max_shifts;
+	profile->frame_count += fed;
+	profile->clip_count += clipped;
+
+	uint32_t cycles = (uint32_t)(cost->sample + cost->voice * ctx->seq_voice_count + cost->active * active + cost->shift * shifts + (fed ? cost->frame : 0) + profile->extra);
+	uint32_t i = profile->count++;
+	profile->total += cycles;
+	if (cycles > profile->worst) {
+		profile->worst = cycles;
+		profile->worst_at = i;
+	}
+	if (cycles > (uint32_t)cost->budget) {
+		profile->overruns++;
+	}
+	uint32_t bucket = cycles * 10 / (uint32_t)cost->budget;
+	profile->histogram[bucket > 10 ? 10 : bucket]++;
+
+	// The ring slot holds the sample leaving the window
+	uint32_t* slot = &profile->window_cycles[i % (uint32_t)cost->window];
+	profile->window_sum += cycles - *slot;
+	*slot = cycles;
+	if (profile->window_sum > profile->worst_window) {
+		profile->worst_window = profile->window_sum;
+		profile->worst_window_at = i >= (uint32_t)cost->window ? i + 1 - (uint32_t)cost->window : 0;
+	}
+}
+
+/*!
+ * Report the profile against the cycle budget: the worst sample, the worst window
+ * of `cost->window` samples, and the histogram of the sample costs.
+ */
+static void seq_profile_print(const struct seq_profile_t* profile, FILE* log) {
+	const struct seq_cost_model_t* cost = profile->cost;
+	if (!profile->count || !log) {
+		return;
+	}
+
+	fprintf(log, "\tcost profile (%d cycles per sample):\n", cost->budget);
+	fprintf(log, "\t\tmax per sample: %d audible voices, %d attack, %d decay/sustain, %d release, %d gain shifts\n",
+		profile->max_active, profile->max_attack, profile->max_decay, profile->max_release, profile->max_shifts);
+	fprintf(log, "\t\tframe feeds: %u, clipped samples: %u\n", profile->frame_count, profile->clip_count);
+	fprintf(log, "\t\taverage: %.1f cycles, worst sample: %u cycles at %u, worst %d-sample window: %.1f cycles at %u\n",
+		(double)profile->total / profile->count, profile->worst, profile->worst_at, cost->window, (double)profile->worst_window / cost->window, profile->worst_window_at);
+	for (int i = 0; i < 11; i++) {
+		if (profile->histogram[i]) {
+			if (i < 10) {
+				fprintf(log, "\t\t%3d-%3d%%: %u samples\n", i * 10, i * 10 + 9, profile->histogram[i]);
+			} else {
+				fprintf(log, "\t\t >100%%: %u samples\n", profile->histogram[i]);
 			}
-			voice_idx++;
-			cur_voice++;
 		}
 	}
+	if (profile->worst_window > (uint32_t)cost->budget * cost->window) {
+		fprintf(log, "\tWARN: FAIL, the %d-sample window overruns the budget (%u samples over budget)\n", cost->window, profile->overruns);
+	} else if (profile->overruns) {
+		fprintf(log, "\tPASS: %u samples over budget, absorbed by the %d-sample window\n", profile->overruns, cost->window);
+	} else {
+		fprintf(log, "\tPASS: all samples in budget\n");
+	}
+}
+
+/*! Add the occupancy of the voices in the last sample to the statistics */
+static void seq_stats_sample(struct seq_stats_t* stats, struct seq_ctx_t* ctx, int clipped) {
+	int busy = 0, audible = 0;
+	const struct voice_ch_t* voice = &ctx->synth.voice[0];
+	struct seq_voice_stats_t* voice_stats = stats->voices;
+	for (int i = 0; i < stats->voice_count; i++, voice++, voice_stats++) {
+		if (voice->adsr.state_counter == ADSR_STATE_END) {
+			continue;
+		}
+		busy++;
+		voice_stats->busy++;
+		int muted = voice->adsr.gain >= 6;
+		int rest = voice->wf.period == 0;
+		voice_stats->muted += muted;
+		voice_stats->rest += rest;
+		audible += !muted && !rest;
+	}
+	stats->busy_histogram[busy]++;
+	stats->audible_histogram[audible]++;
+
+	if (clipped) {
+		// Extend the last run, or start a new one
+		struct seq_clip_run_t* run = stats->clip_run_count ? &stats->clip_runs[stats->clip_run_count - 1] : NULL;
+		if (run && run->start + run->length == stats->sample_count) {
+			run->length++;
+		} else {
+			stats->clip_runs = realloc(stats->clip_runs, sizeof(struct seq_clip_run_t) * (stats->clip_run_count + 1));
+			stats->clip_runs[stats->clip_run_count].start = stats->sample_count;
+			stats->clip_runs[stats->clip_run_count++].length = 1;
+		}
+	}
+	stats->sample_count++;
+}
+
+/*! Prepare a private synth context to play the stream */
+static void seq_simulate_init(struct seq_ctx_t* ctx, struct compiler_source_t* source, int voice_count, int options) {
+	seq_ctx_init(ctx, compiler_frame_require, source);
+#ifdef SEQ_FEED_COMPENSATE
+	ctx->feed_compensate = (options & SEQ_COMPILE_COMPENSATE) != 0;
+#endif
+	seq_play_stream(ctx, voice_count);
+}
+
+/*! Play the stream on a private synth context, block by block, and count the clipped samples */
+static int seq_clip_count(const struct seq_frame_t* frame_stream, int frame_count, int voice_count, int options) {
+	struct compiler_source_t source = { frame_stream, frame_count, 0 };
+	struct seq_ctx_t ctx;
+	int8_t block[SEQ_BLOCK_SIZE];
+	seq_simulate_init(&ctx, &source, voice_count, options);
+	while (!ctx.seq_end) {
+		seq_render_block(&ctx, block, SEQ_BLOCK_SIZE);
+	}
+	return ctx.clip_count;
+}
+
+/*!
+ * Play the stream on a private synth context, sample by sample: profile the per-sample work
+ * over the `cost` model (if not NULL, reported to `log`), and collect the polyphony `stats` (if not NULL).
+ * `clip_check` tells if the player checks the clipping, at the `cost->clip` cycles per sample.
+ */
+static void seq_simulate(const struct seq_frame_t* frame_stream, int frame_count, int voice_count, int options, const struct seq_cost_model_t* cost, int clip_check, struct seq_stats_t* stats, FILE* log) {
+	struct compiler_source_t source = { frame_stream, frame_count, 0 };
+	struct seq_ctx_t ctx;
+	struct seq_profile_t profile;
+	if (cost) {
+		seq_profile_init(&profile, cost, clip_check);
+	}
+
+	seq_simulate_init(&ctx, &source, voice_count, options);
+	while (!ctx.seq_end) {
+		int pos = source.pos;
+		int clip_count = ctx.clip_count;
+		seq_feed_synth(&ctx);
+		if (cost) {
+			seq_profile_sample(&profile, &ctx, source.pos != pos, ctx.clip_count != clip_count);
+		}
+		if (stats) {
+			seq_stats_sample(stats, &ctx, ctx.clip_count != clip_count);
+		}
+	}
+
+	if (cost) {
+		seq_profile_print(&profile, log);
+		free(profile.window_cycles);
+	}
+}
+#endif
+
+/*! Sample count of a whole envelope, from the frame feed to `ADSR_STATE_END` */
+static uint32_t seq_frame_duration(const struct seq_frame_t* frame) {
+	// (ADSR_TIME_UNITS + 1) state steps, each one lasting time_scale + 1 samples
+	return (uint32_t)(ADSR_TIME_UNITS + 1) * ((uint32_t)frame->adsr_time_scale_1 + 1);
+}
+
+/*! A voice event: the voice becomes free at the given sample */
+struct compiler_event_t {
+	uint32_t time;
+	int voice;
+};
+
+/*! Min-heap of events, sorted by time and then by voice index */
+struct compiler_queue_t {
+	struct compiler_event_t* events;
+	int count;
+};
+
+static int event_less(const struct compiler_event_t* a, const struct compiler_event_t* b) {
+	return a->time < b->time || (a->time == b->time && a->voice < b->voice);
+}
+
+static void queue_push(struct compiler_queue_t* queue, uint32_t time, int voice) {
+	int i = queue->count++;
+	struct compiler_event_t event = { time, voice };
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (!event_less(&event, &queue->events[parent])) {
+			break;
+		}
+		queue->events[i] = queue->events[parent];
+		i = parent;
+	}
+	queue->events[i] = event;
 }
 
-void seq_compile(struct seq_frame_map_t* map, struct seq_frame_t** frame_stream, int* frame_count, int* voice_count, int* do_clip_check) {
+static struct compiler_event_t queue_pop(struct compiler_queue_t* queue) {
+	struct compiler_event_t top = queue->events[0];
+	struct compiler_event_t last = queue->events[--queue->count];
+	int i = 0;
+	while (1) {
+		int child = i * 2 + 1;
+		if (child >= queue->count) {
+			break;
+		}
+		if (child + 1 < queue->count && event_less(&queue->events[child + 1], &queue->events[child])) {
+			child++;
+		}
+		if (!event_less(&queue->events[child], &last)) {
+			break;
+		}
+		queue->events[i] = queue->events[child];
+		i = child;
+	}
+	queue->events[i] = last;
+	return top;
+}
+
+void seq_compile(struct seq_frame_map_t* map, int options, const struct seq_cost_model_t* cost, struct seq_stats_t* stats, FILE* log, struct seq_frame_t** frame_stream, int* frame_count, int* voice_count, int* do_clip_check) {
 	int total_frame_count = 0;
 	// Skip empty channels
 	int valid_channel_count = 0;
@@ -82,98 +325,601 @@ void seq_compile(struct seq_frame_map_t* map, struct seq_frame_t** frame_stream,
 		}
 	}
 
+	if (stats) {
+		memset(stats, 0, sizeof(struct seq_stats_t));
+		stats->voice_count = valid_channel_count;
+		stats->voices = calloc(valid_channel_count, sizeof(struct seq_voice_stats_t));
+		stats->busy_histogram = calloc(valid_channel_count + 1, sizeof(uint32_t));
+		stats->audible_histogram = calloc(valid_channel_count + 1, sizeof(uint32_t));
+	}
+
 	// Prepare output buffer, with total frame count
 	*frame_count = total_frame_count;
 	*voice_count = valid_channel_count;
 	*frame_stream = malloc(sizeof(struct seq_frame_t) * (*frame_count));
 
-	// Now play sequencer data, currently by channel, simulating the timing of the synth.
-	for (int i = 0; i < VOICE_COUNT; i++) {
-		synth.voice[i].adsr.state_counter = ADSR_STATE_END;
-	}
-
-	struct compiler_state_t state;
-	state.channels = malloc(sizeof(struct compiler_channel_state_t) * valid_channel_count);
-	memset(state.channels, 0, sizeof(struct compiler_channel_state_t) * valid_channel_count);
-	state.input_map = map;
-	state.out_stream = *frame_stream;
-	state.stream_position = 0;
-
-	seq_feed_channels(&state);
-	int end;
-	do {
-		// poly_synth_next();
-		for (uint8_t i = 0; i < VOICE_COUNT; i++) {
-			cur_voice = &synth.voice[i];
-			voice_ch_next();
-		}
-		seq_feed_channels(&state);
-
-		end = 1;
-		for (int i = 0; i < VOICE_COUNT; i++) {
-			if (synth.voice[i].adsr.state_counter != ADSR_STATE_END) {
-				end = 0;
-				break;
+	// Valid channels, in voice order, and their read positions
+	const struct seq_frame_list_t** voices = malloc(sizeof(struct seq_frame_list_t*) * valid_channel_count);
+	int* positions = malloc(sizeof(int) * valid_channel_count);
+	for (int i = 0, voice = 0; i < map->channel_count; i++) {
+		if (map->channels[i].count > 0) {
+			positions[voice] = 0;
+			voices[voice++] = &map->channels[i];
+		}
+	}
+
+	// Now play sequencer data, jumping between the envelope ends of the voices, reproducing 
+	// the timing of the synth. The synth feeds at most one frame per sample: the free voice with
+	// the lower index first.
+	// Voices waiting for the end of their envelope, by time
+	struct compiler_queue_t busy = { malloc(sizeof(struct compiler_event_t) * valid_channel_count), 0 };
+	// Free voices with frames to play, by voice index
+	struct compiler_queue_t free_voices = { malloc(sizeof(struct compiler_event_t) * valid_channel_count), 0 };
+	for (int i = 0; i < valid_channel_count; i++) {
+		queue_push(&free_voices, 0, i);
+	}
+
+	// Timing of the voices: when they got free, and when the tune would start their next note
+	uint32_t* free_times = calloc(valid_channel_count, sizeof(uint32_t));
+	uint32_t* ideal_times = calloc(valid_channel_count, sizeof(uint32_t));
+	uint32_t* max_latencies = calloc(valid_channel_count, sizeof(uint32_t));
+	int32_t* phase_errors = calloc(valid_channel_count, sizeof(int32_t));
+	int late_count = 0;
+
+	uint32_t time = 0;
+	for (int stream_position = 0; stream_position < total_frame_count; ) {
+		while (busy.count > 0 && busy.events[0].time <= time) {
+			int voice = queue_pop(&busy).voice;
+			free_times[voice] = time;
+			queue_push(&free_voices, 0, voice);
+		}
+		if (!free_voices.count) {
+			// Jump to the next envelope end
+			time = busy.events[0].time;
+			continue;
+		}
+
+		// Feed data
+		int voice = queue_pop(&free_voices).voice;
+		struct seq_frame_t* frame = &voices[voice]->frames[positions[voice]++];
+		(*frame_stream)[stream_position] = *frame;
+#ifdef WAVEFORM_RAMPS
+		// The frames are final: precompute the ramp steps, instead of dividing in the synth
+		voice_wf_setup_step(&(*frame_stream)[stream_position]);
+#endif
+		stream_position++;
+
+		// The voice started late if other voices were fed in the same samples
+		uint32_t latency = time - free_times[voice];
+		if (latency) {
+			late_count++;
+			if (latency > max_latencies[voice]) {
+				max_latencies[voice] = latency;
 			}
 		}
-	} while(!end);
+		phase_errors[voice] = (int32_t)(time - ideal_times[voice]);
+		ideal_times[voice] += seq_frame_duration(frame);
 
-	printf("Compiler stats:\n");
-	if (clip_count) {
-		printf("\tWARN: clip count: %d (slower)\n", clip_count);
-		*do_clip_check = 1;
-	} else {
-		printf("\tno clip (faster)\n");
-		*do_clip_check = 0;
+		if (positions[voice] < voices[voice]->count) {
+			uint32_t duration = seq_frame_duration(frame);
+			if (options & SEQ_COMPILE_COMPENSATE) {
+				// The player shortens the first envelope step by the delay (saturated to 8 bits)
+				uint32_t late = latency < UINT8_MAX ? latency : UINT8_MAX;
+				duration -= late < frame->adsr_time_scale_1 ? late : frame->adsr_time_scale_1;
+			}
+			queue_push(&busy, time + duration, voice);
+		}
+
+		// Don't overload the CPU with multiple frames per sample
+		// This will create minimum phase errors (of 1 sample period) but will keep the process real-time on slower CPUs
+		time++;
 	}
 
-	free(state.channels);
+	if (log) {
+		fprintf(log, "Compiler stats:\n");
+		fprintf(log, "\tlate notes: %d of %d%s\n", late_count, total_frame_count, (options & SEQ_COMPILE_COMPENSATE) ? " (compensated)" : "");
+		for (int i = 0; i < valid_channel_count; i++) {
+			fprintf(log, "\tvoice %d: max start latency %u samples, phase error at the last note %d samples\n", i, max_latencies[i], phase_errors[i]);
+		}
+	}
+	free(free_times);
+	free(ideal_times);
+	free(max_latencies);
+	free(phase_errors);
+	int clip_count = 0;
+#if defined(SEQ_REENTRANT) && defined(CHECK_CLIPPING)
+	if (valid_channel_count <= VOICE_COUNT) {
+		clip_count = seq_clip_count(*frame_stream, total_frame_count, valid_channel_count, options);
+		// The per-sample pass only when asked for
+		if (cost || stats) {
+			seq_simulate(*frame_stream, total_frame_count, valid_channel_count, options, cost, clip_count > 0, stats, log);
+		}
+	} else if (log) {
+		fprintf(log, "\tWARN: %d voices, more than the synth ones: can't check clipping\n", valid_channel_count);
+	}
+#endif
+	*do_clip_check = clip_count > 0;
+	if (log) {
+		if (clip_count) {
+			fprintf(log, "\tWARN: clip count: %d (slower)\n", clip_count);
+		} else {
+			fprintf(log, "\tno clip (faster)\n");
+		}
+	}
+
+	free(busy.events);
+	free(free_voices.events);
+	free(positions);
+	free(voices);
 }
 
 void seq_free(struct seq_frame_t* seq_frame_stream) {
 	free(seq_frame_stream);
 }
 
-struct distribution16_t {
-	// Distribution map
-	int map[0x10000];
-	// Reverse map, from value to index
-	int map_of_refs[0x10000];
+void seq_stats_free(struct seq_stats_t* stats) {
+	free(stats->voices);
+	free(stats->busy_histogram);
+	free(stats->audible_histogram);
+	free(stats->clip_runs);
+}
+
+/*! A distinct value of a quantized field, and its frame count */
+struct quantize_value_t {
+	int value;
+	int count;
+};
+
+static int quantize_value_compare(const void* a, const void* b) {
+	return ((const struct quantize_value_t*)a)->value - ((const struct quantize_value_t*)b)->value;
+}
+
+/*! The most frequent first, then by value */
+static int quantize_count_compare(const void* a, const void* b) {
+	const struct quantize_value_t* x = a;
+	const struct quantize_value_t* y = b;
+	return x->count != y->count ? y->count - x->count : x->value - y->value;
+}
+
+/*! Quantized fields: the time scale (0) or the period (1) */
+static uint16_t* quantize_field(struct seq_frame_t* frame, int field) {
+	return field ? &frame->wf_period : &frame->adsr_time_scale_1;
+}
+
+/*! Distance of two values of the field: in samples for the time scales, in cents for the periods */
+static double quantize_distance(int field, int a, int b) {
+	if (field) {
+		return fabs(1200.0 * log2((double)a / b));
+	}
+	return fabs((double)(a - b)) * (ADSR_TIME_UNITS + 1);
+}
+
+/*!
+ * Distinct values of the field in the map, with their frame counts. The zero values are excluded:
+ * a rest has no pitch, and a zero time scale is the stream end. Returns the count of distinct values.
+ */
+static int quantize_collect(struct seq_frame_map_t* map, int field, struct quantize_value_t** values) {
+	int frame_count = 0;
+	for (int i = 0; i < map->channel_count; i++) {
+		frame_count += map->channels[i].count;
+	}
+	*values = malloc(sizeof(struct quantize_value_t) * (frame_count + 1));
+	int count = 0;
+	for (int i = 0; i < map->channel_count; i++) {
+		for (int j = 0; j < map->channels[i].count; j++) {
+			int value = *quantize_field(&map->channels[i].frames[j], field);
+			if (value) {
+				(*values)[count].value = value;
+				(*values)[count++].count = 1;
+			}
+		}
+	}
+	qsort(*values, count, sizeof(struct quantize_value_t), quantize_value_compare);
+	int distinct = 0;
+	for (int i = 0; i < count; i++) {
+		if (distinct && (*values)[i].value == (*values)[distinct - 1].value) {
+			(*values)[distinct - 1].count++;
+		} else {
+			(*values)[distinct++] = (*values)[i];
+		}
+	}
+	return distinct;
+}
+
+/*! Bits of a fixed-size ref to `count` values */
+static int quantize_bits(int count) {
+	int bits = 0;
+	while ((1 << bits) < count) {
+		bits++;
+	}
+	return bits;
+}
+
+void seq_quantize(struct seq_frame_map_t* map, const struct seq_quantize_t* tolerance, FILE* log) {
+	static const char* names[2] = { "adsr_time_scale", "wf_period" };
+	double tolerances[2] = { tolerance->samples, tolerance->cents };
+	int max_drift = 0;
+
+	if (log) {
+		fprintf(log, "Quantization (%.1f cents, %d samples):\n", tolerance->cents, tolerance->samples);
+	}
+	for (int field = 0; field < 2; field++) {
+		struct quantize_value_t* values;
+		int count = quantize_collect(map, field, &values);
+
+		// Cluster centers: the most frequent values, each one absorbing the less frequent values in tolerance
+		qsort(values, count, sizeof(struct quantize_value_t), quantize_count_compare);
+		int* centers = malloc(sizeof(int) * (count + 1));
+		int center_count = 0;
+		for (int i = 0; i < count; i++) {
+			int absorbed = 0;
+			for (int j = 0; j < center_count && !absorbed; j++) {
+				absorbed = quantize_distance(field, values[i].value, centers[j]) <= tolerances[field];
+			}
+			if (!absorbed) {
+				centers[center_count++] = values[i].value;
+			}
+		}
+
+		for (int i = 0; i < map->channel_count; i++) {
+			// Time scales: the timing error of the voice is carried to its next notes, so that the channels don't drift
+			int drift = 0;
+			for (int j = 0; j < map->channels[i].count; j++) {
+				uint16_t* value = quantize_field(&map->channels[i].frames[j], field);
+				if (!*value) {
+					continue;
+				}
+				int best = *value;
+				double best_error = -1;
+				for (int k = 0; k < center_count; k++) {
+					double distance = quantize_distance(field, *value, centers[k]);
+					if (distance > tolerances[field]) {
+						continue;
+					}
+					// Periods: the nearest pitch. Time scales: the smallest drift, then the nearest
+					double error = field ? distance : abs(drift + (centers[k] - *value) * (ADSR_TIME_UNITS + 1)) + distance * 1e-6;
+					if (best_error < 0 || error < best_error) {
+						best = centers[k];
+						best_error = error;
+					}
+				}
+				if (!field) {
+					if (abs(drift + (best - *value) * (ADSR_TIME_UNITS + 1)) > tolerance->samples) {
+						// The voice would drift out of tolerance: the note keeps its value
+						best = *value;
+					}
+					drift += (best - *value) * (ADSR_TIME_UNITS + 1);
+					if (abs(drift) > max_drift) {
+						max_drift = abs(drift);
+					}
+				}
+				*value = best;
+			}
+		}
+		free(centers);
+		free(values);
+
+		int quantized_count = quantize_collect(map, field, &values);
+		free(values);
+		if (log) {
+			fprintf(log, "\t%s: %d -> %d values, %d -> %d bits\n", names[field], count, quantized_count, quantize_bits(count), quantize_bits(quantized_count));
+		}
+	}
+	if (log) {
+		fprintf(log, "\tmax channel drift: %d samples\n", max_drift);
+	}
+}
+
+/*!
+ * Histogram of the values of a frame field. Sized to the frame count: the values
+ * are collected, then sorted and deduplicated.
+ */
+struct distribution_t {
+	/*! Collected values, one per frame. Then the distinct values, ascending */
+	int* values;
+	int count;
+	/*! Frequency of the distinct values */
+	int* freqs;
+	/*! Ref index, code and code length of the distinct values */
+	int* refs_of_values;
+	uint16_t* codes;
+	uint8_t* lengths;
+	/*! Output ref map */
 	struct ref_map_t refs;
 };
 
-static struct distribution16_t dist_adsr_time_scale;
-static struct distribution16_t dist_wf_period;
-static struct distribution16_t dist_wf_amplitude;
-static struct distribution16_t dist_adsr_release_start;
+static void distribution_init(struct distribution_t* dist, int* values) {
+	memset(dist, 0, sizeof(struct distribution_t));
+	dist->values = values;
+}
+
+static void distribution_add(struct distribution_t* dist, int value) {
+	dist->values[dist->count++] = value;
+}
+
+static int value_compare(const void* a, const void* b) {
+	int x = *(const int*)a;
+	int y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+/*!
+ * Compute the Huffman code lengths of `n` symbols, limited to `max_bits`.
+ * Frequencies are halved until the tree is shallow enough.
+ */
+static void huffman_lengths(const int* freqs, int n, uint8_t* lengths, int max_bits) {
+	int* weights = malloc(sizeof(int) * n * 2);
+	int* parents = malloc(sizeof(int) * n * 2);
+	uint8_t* merged = malloc(n * 2);
+	int* scaled = malloc(sizeof(int) * n);
+	memcpy(scaled, freqs, sizeof(int) * n);
+
+	while (1) {
+		memcpy(weights, scaled, sizeof(int) * n);
+		memset(merged, 0, n * 2);
+		// Merge the two lighter nodes, until the root (node 2n-2)
+		for (int k = n; k < n * 2 - 1; k++) {
+			int a = -1, b = -1;
+			for (int i = 0; i < k; i++) {
+				if (merged[i]) {
+					continue;
+				}
+				if (a < 0 || weights[i] < weights[a]) {
+					b = a;
+					a = i;
+				} else if (b < 0 || weights[i] < weights[b]) {
+					b = i;
+				}
+			}
+			merged[a] = merged[b] = 1;
+			parents[a] = parents[b] = k;
+			weights[k] = weights[a] + weights[b];
+		}
+
+		int max_length = 0;
+		for (int i = 0; i < n; i++) {
+			int length = 0;
+			for (int j = i; j != n * 2 - 2; j = parents[j]) {
+				length++;
+			}
+			lengths[i] = length;
+			if (length > max_length) {
+				max_length = length;
+			}
+		}
+		if (max_length <= max_bits) {
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			scaled[i] = (scaled[i] + 1) / 2;
+		}
+	}
+
+	free(weights);
+	free(parents);
+	free(merged);
+	free(scaled);
+}
+
+/*! Index of `value` in the distinct values */
+static int distribution_find(const struct distribution_t* dist, int value) {
+	const int* ref = bsearch(&value, dist->values, dist->refs.count, sizeof(int), value_compare);
+	return (int)(ref - dist->values);
+}
+
+/*! 
+ * Build the canonical Huffman codes: refs are sorted by code length (then by value),
+ * so the decoder only needs the count of codes of each length.
+ */
+static void distribution_huffman(struct distribution_t* dist) {
+	int n = dist->refs.count;
+	huffman_lengths(dist->freqs, n, dist->lengths, STREAM_HUFFMAN_MAX_BITS);
+
+	int* order = malloc(sizeof(int) * n);
+	int k = 0;
+	int max_length = 0;
+	for (int length = 0; length <= STREAM_HUFFMAN_MAX_BITS; length++) {
+		for (int i = 0; i < n; i++) {
+			if (dist->lengths[i] == length) {
+				order[k++] = i;
+				max_length = length;
+			}
+		}
+	}
+
+	dist->refs.bit_count = max_length;
+	dist->refs.code_counts = calloc(max_length + 1, 1);
+	uint16_t code = 0;
+	for (k = 0; k < n; k++) {
+		int i = order[k];
+		if (k > 0) {
+			code = (code + 1) << (dist->lengths[i] - dist->lengths[order[k - 1]]);
+		}
+		dist->codes[i] = code;
+		dist->refs_of_values[i] = k;
+		dist->refs.values[k] = dist->values[i];
+		if (dist->lengths[i]) {
+			dist->refs.code_counts[dist->lengths[i] - 1]++;
+		}
+	}
+	free(order);
+}
+
+static void distribution_calc(struct distribution_t* dist, int options) {
+	// Sort and count the distinct values
+	qsort(dist->values, dist->count, sizeof(int), value_compare);
+	dist->freqs = malloc(sizeof(int) * (dist->count + 1));
+	for (int i = 0; i < dist->count; i++) {
+		if (!i || dist->values[i] != dist->values[dist->refs.count - 1]) {
+			dist->values[dist->refs.count] = dist->values[i];
+			dist->freqs[dist->refs.count++] = 0;
+		}
+		dist->freqs[dist->refs.count - 1]++;
+	}
+
+	int n = dist->refs.count;
+	dist->refs.bit_count = ceil(log(n) / log(2));
+	dist->refs.values = malloc(sizeof(int) * n);
+	dist->refs_of_values = malloc(sizeof(int) * n);
+	dist->codes = malloc(sizeof(uint16_t) * n);
+	dist->lengths = malloc(n);
+
+	if ((options & STREAM_HUFFMAN) && dist->refs.bit_count <= STREAM_HUFFMAN_MAX_BITS) {
+		distribution_huffman(dist);
+	} else {
+		// Padded refs keep the fields on nibble or byte boundaries
+		if (dist->refs.bit_count && (options & STREAM_ALIGN_BYTE)) {
+			dist->refs.bit_count = 8;
+		} else if (dist->refs.bit_count && (options & STREAM_ALIGN_NIBBLE)) {
+			dist->refs.bit_count = dist->refs.bit_count <= 4 ? 4 : 8;
+		}
+		for (int i = 0; i < n; i++) {
+			dist->refs.values[i] = dist->values[i];
+			dist->refs_of_values[i] = i;
+			dist->codes[i] = i;
+			dist->lengths[i] = dist->refs.bit_count;
+		}
+	}
+
+	dist->refs.total_bits = 0;
+	for (int i = 0; i < n; i++) {
+		dist->refs.total_bits += dist->freqs[i] * dist->lengths[i];
+	}
+}
+
+/*! Code length of `value` */
+static int distribution_length(const struct distribution_t* dist, int value) {
+	return dist->lengths[distribution_find(dist, value)];
+}
+
+static void distribution_free(struct distribution_t* dist) {
+	free(dist->freqs);
+	free(dist->refs_of_values);
+	free(dist->codes);
+	free(dist->lengths);
+}
+
+/*! Free the ref map too, when not moved to the output stream */
+static void distribution_free_refs(struct distribution_t* dist) {
+	distribution_free(dist);
+	free(dist->refs.values);
+	free(dist->refs.code_counts);
+}
+
+/*! The frames as symbols to code: the frame fields, or a single tuple index */
+struct stream_symbols_t {
+	int field_count;
+	int frame_count;
+	/*! `field_count` rows of `frame_count` symbols */
+	int* symbols;
+};
+
+static int symbol_at(const struct stream_symbols_t* syms, int field, int i) {
+	return syms->symbols[field * syms->frame_count + i];
+}
 
-static void distribution_init(struct distribution16_t* dist) {
-	memset(dist->map, 0, 0x10000 * sizeof(int));
-	memset(dist->map_of_refs, 0xff, 0x10000 * sizeof(int));
-	dist->refs.count = 0;
-    dist->refs.values = 0;
+static int symbols_equal(const struct stream_symbols_t* syms, int a, int b) {
+	for (int field = 0; field < syms->field_count; field++) {
+		if (symbol_at(syms, field, a) != symbol_at(syms, field, b)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*! Code length of the `i`-th frame */
+static int symbols_length(const struct stream_symbols_t* syms, const struct distribution_t* dists, int i) {
+	int bits = 0;
+	for (int field = 0; field < syms->field_count; field++) {
+		bits += distribution_length(&dists[field], symbol_at(syms, field, i));
+	}
+	return bits;
 }
 
-static void distribution_add(struct distribution16_t* dist, uint16_t value) {
-	if (!dist->map[value]) {
-		dist->refs.count++;
+/*!
+ * Analyze the symbols to extract the ref tables of the fields.
+ * Frames covered by back-references (`backrefs[i] < 0`) are skipped, and the
+ * escape symbol (0 on the first field, as the end-of-stream frame) is counted `escape_count` times.
+ */
+static void stream_analyze(struct distribution_t* dists, int* values, const struct stream_symbols_t* syms, const int* backrefs, int escape_count, int options) {
+	// The first field can hold a value per frame, plus the escapes
+	distribution_init(&dists[0], values);
+	for (int field = 1; field < syms->field_count; field++) {
+		distribution_init(&dists[field], values + syms->frame_count * (field + 1) + 1);
+	}
+	for (int i = 0; i < escape_count; i++) {
+		distribution_add(&dists[0], 0);
+	}
+	for (int i = 0; i < syms->frame_count; i++) {
+		if (backrefs && backrefs[i] < 0) {
+			continue;
+		}
+		for (int field = 0; field < syms->field_count; field++) {
+			distribution_add(&dists[field], symbol_at(syms, field, i));
+		}
+	}
+	for (int field = 0; field < syms->field_count; field++) {
+		distribution_calc(&dists[field], options);
 	}
-	dist->map[value]++;
 }
 
-static void distribution_calc(struct distribution16_t* dist) {
-	dist->refs.bit_count = ceil(log(dist->refs.count) / log(2));
-	printf("%d (%d bits)\n", dist->refs.count, dist->refs.bit_count);
+/*!
+ * Greedy search of the repeated runs of frames, to replace with back-references to the first occurrence.
+ * Only runs of literal frames can be referenced, so the decoder never nests back-references.
+ * `backrefs` is set to the run length at the start of a back-reference, to -1 for the following frames
+ * of the run, and to 0 for the literal frames. `sources` is set to the first frame of the referenced run.
+ * Literal frame costs are taken from `dists`, the token cost is `token_bits`. Returns the back-reference count.
+ */
+static int backref_find(const struct stream_symbols_t* syms, const struct distribution_t* dists, int token_bits, int* backrefs, int* sources) {
+	int frame_count = syms->frame_count;
+	int* costs = malloc(sizeof(int) * (frame_count + 1));
+	for (int i = 0; i < frame_count; i++) {
+		costs[i] = symbols_length(syms, dists, i);
+	}
+
+	int count = 0;
+	for (int i = 0; i < frame_count; ) {
+		int best_length = 0;
+		int best_source = 0;
+		for (int j = 0; j < i; j++) {
+			int length = 0;
+			while (length < STREAM_BACKREF_MAX_LENGTH && i + length < frame_count && j + length < i && 
+				!backrefs[j + length] && symbols_equal(syms, j + length, i + length)) {
+				length++;
+			}
+			if (length > best_length) {
+				best_length = length;
+				best_source = j;
+			}
+		}
+
+		int saved_bits = -token_bits;
+		for (int k = 0; k < best_length; k++) {
+			saved_bits += costs[i + k];
+		}
+		if (saved_bits > 0) {
+			backrefs[i] = best_length;
+			sources[i] = best_source;
+			for (int k = 1; k < best_length; k++) {
+				backrefs[i + k] = -1;
+			}
+			i += best_length;
+			count++;
+		} else {
+			backrefs[i++] = 0;
+		}
+	}
+	free(costs);
+	return count;
+}
 
-    dist->refs.values = malloc(sizeof(int) * dist->refs.count);
-    int j = 0;
-    for (int i = 0; i < 0x10000; i++) {
-        if (dist->map[i]) {
-            dist->refs.values[j] = i;
-            dist->map_of_refs[i] = j;
-            j++;
-        }
-    }
+/*! Bits used by `value` */
+static int bits_of(int value) {
+	int bits = 0;
+	for (; value; value >>= 1) {
+		bits++;
+	}
+	return bits;
 }
 
 struct stream_writer_t {
@@ -197,54 +943,129 @@ static void write_bits(struct stream_writer_t* writer, uint8_t data, uint8_t bit
 	}
 }
 
-int stream_compress(struct seq_frame_t* frame_stream, int frame_count, struct bit_stream_t* stream) {
-	// Analyze the stream to extract the data ref tables
-	distribution_init(&dist_adsr_time_scale);
-	distribution_init(&dist_wf_period);
-	distribution_init(&dist_wf_amplitude);
-	distribution_init(&dist_adsr_release_start);
+/*! Write a value wider than 8 bits: low byte first */
+static void write_value(struct stream_writer_t* writer, int value, int bits) {
+	if (bits > 8) {
+		write_bits(writer, value & 0xff, 8);
+		value >>= 8;
+		bits -= 8;
+	}
+	write_bits(writer, value, bits);
+}
 
-	for (int i = 0; i < frame_count; i++) {
-		struct seq_frame_t* frame = frame_stream + i;
-		distribution_add(&dist_adsr_time_scale, frame->adsr_time_scale_1);
-		distribution_add(&dist_wf_period, frame->wf_period);
-		distribution_add(&dist_wf_amplitude, frame->wf_amplitude);
-		distribution_add(&dist_adsr_release_start, frame->adsr_release_start);
-	}
-
-	printf("Distribution chart for %d frames:\n", frame_count);
-	printf("\tadsr_time_scale: ");
-	distribution_calc(&dist_adsr_time_scale);
-	printf("\twf_period: ");
-	distribution_calc(&dist_wf_period);
-	printf("\twf_amplitude: ");
-	distribution_calc(&dist_wf_amplitude);
-	printf("\tadsr_release_start: ");
-	distribution_calc(&dist_adsr_release_start);
-
-	// Copy output ref maps
-	stream->refs_adsr_time_scale = dist_adsr_time_scale.refs;
-	stream->refs_wf_period = dist_wf_period.refs;
-	stream->refs_wf_amplitude = dist_wf_amplitude.refs;
-	stream->refs_adsr_release_start = dist_adsr_release_start.refs;
+/*! Write the ref of `value`. Huffman codes are written MSB first, a bit at a time */
+static void write_ref(struct stream_writer_t* writer, const struct distribution_t* dist, int options, int value) {
+	int i = distribution_find(dist, value);
+	if (options & STREAM_HUFFMAN) {
+		for (int bit = dist->lengths[i] - 1; bit >= 0; bit--) {
+			write_bits(writer, (dist->codes[i] >> bit) & 1, 1);
+		}
+	} else {
+		write_bits(writer, dist->refs_of_values[i], dist->refs.bit_count);
+	}
+}
+
+/*! Size in bits of a back-reference token */
+static int backref_token_bits(const struct distribution_t* dists, int offset_bits) {
+	return distribution_length(&dists[0], 0) + STREAM_BACKREF_LENGTH_BITS + 3 + offset_bits;
+}
+
+/*!
+ * Code the symbols to the bit stream. The ref maps of the fields are returned in `refs`,
+ * the escape symbol is 0 in the first field.
+ */
+static int stream_encode(const struct stream_symbols_t* syms, int options, struct bit_stream_t* stream, struct ref_map_t* refs) {
+	int frame_count = syms->frame_count;
+	int field_count = syms->field_count;
+	struct distribution_t dists[STREAM_FIELD_COUNT];
+	int* values = malloc(sizeof(int) * (frame_count * (field_count + 1) + 1));
+	int* backrefs = NULL;
+	int* sources = NULL;
+	int* positions = NULL;
+	int escape_count = (options & STREAM_END_FRAME) ? 1 : 0;
+
+	stream->backref_count = 0;
+	if (options & STREAM_BACKREF) {
+		// Estimate the frame costs without back-references, and the size of the offsets
+		stream_analyze(dists, values, syms, NULL, 1, options);
+		int literal_bits = 0;
+		for (int i = 0; i < frame_count; i++) {
+			literal_bits += symbols_length(syms, dists, i);
+		}
+
+		backrefs = malloc(sizeof(int) * (frame_count + 1));
+		sources = malloc(sizeof(int) * (frame_count + 1));
+		stream->backref_count = backref_find(syms, dists, backref_token_bits(dists, bits_of(literal_bits / 8)), backrefs, sources);
+		escape_count += stream->backref_count;
+		for (int field = 0; field < field_count; field++) {
+			distribution_free_refs(&dists[field]);
+		}
+	}
 
+	stream_analyze(dists, values, syms, backrefs, escape_count, options);
+
+	// Output ref maps
+	stream->options = options;
+	for (int field = 0; field < field_count; field++) {
+		refs[field] = dists[field].refs;
+	}
+	stream->escape_ref = (options & STREAM_END_FRAME) ? dists[0].refs_of_values[distribution_find(&dists[0], 0)] : 0;
+	stream->backref_offset_bits = 0;
+	stream->data = NULL;
+	stream->data_size = 0;
+
+	int err = 0;
 	// Check limitation of uncompress algo
-	if (dist_adsr_time_scale.refs.bit_count > 8 || 
-		dist_wf_period.refs.bit_count > 8 || 
-		dist_wf_amplitude.refs.bit_count > 8 || 
-		dist_adsr_release_start.refs.bit_count > 8) {
-		fprintf(stderr, "Field ref doesn't fit in 8 bit");
-		return 1;
+	for (int field = 0; field < field_count; field++) {
+		if (dists[field].refs.count > 256) {
+			fprintf(stderr, "Field ref doesn't fit in 8 bit");
+			err = 1;
+			goto cleanup;
+		}
 	}
 
-	int bits_per_frame = dist_adsr_time_scale.refs.bit_count + dist_wf_period.refs.bit_count + dist_wf_amplitude.refs.bit_count + dist_adsr_release_start.refs.bit_count;
-	// The last frame data will be all 0s
-	stream->data_size = (int)ceil((frame_count + 2) * bits_per_frame / 8.0);
-	printf("Stream size: %d bytes\n", stream->data_size);
+	int bits_per_frame = 0;
+	int stream_bits = 0;
+	for (int field = 0; field < field_count; field++) {
+		bits_per_frame += dists[field].refs.bit_count;
+		stream_bits += dists[field].refs.total_bits;
+	}
+
+	if (options & STREAM_BACKREF) {
+		// Bit position of the literal frames, with offsets wide enough to address the whole stream
+		positions = malloc(sizeof(int) * (frame_count + 1));
+		int offset_bits = 0;
+		int total_bits;
+		do {
+			offset_bits++;
+			total_bits = 0;
+			for (int i = 0; i < frame_count; i++) {
+				positions[i] = total_bits;
+				if (!backrefs[i]) {
+					total_bits += symbols_length(syms, dists, i);
+				} else if (backrefs[i] > 0) {
+					total_bits += backref_token_bits(dists, offset_bits);
+				}
+			}
+		} while (bits_of(total_bits / 8) > offset_bits);
+		stream->backref_offset_bits = offset_bits;
+		// Escapes are already in the stream bits, as refs of the first field
+		stream_bits = total_bits + distribution_length(&dists[0], 0) + STREAM_BACKREF_LENGTH_BITS;
+	}
+
+	int buffer_size;
+	if (options & STREAM_END_FRAME) {
+		// Room for the end frame
+		buffer_size = (stream_bits + bits_per_frame) / 8 + 1;
+	} else {
+		// The last frame data will be all 0s
+		stream->data_size = (int)ceil((frame_count + 2) * bits_per_frame / 8.0);
+		buffer_size = stream->data_size;
+	}
 
 	// +1 again for the write_bits rounding
-	stream->data = malloc(stream->data_size + 1);
-	memset(stream->data, 0, stream->data_size + 1);
+	stream->data = malloc(buffer_size + 1);
+	memset(stream->data, 0, buffer_size + 1);
 
 	// Now compile down the bit stream
 	struct stream_writer_t stream_writer;
@@ -252,28 +1073,392 @@ int stream_compress(struct seq_frame_t* frame_stream, int frame_count, struct bi
 	stream_writer.pos = 0;
 	stream_writer.bit_pos = 0;
 	for (int i = 0; i < frame_count; i++) {
-		write_bits(&stream_writer, dist_adsr_time_scale.map_of_refs[frame_stream[i].adsr_time_scale_1], dist_adsr_time_scale.refs.bit_count);
-		write_bits(&stream_writer, dist_wf_period.map_of_refs[frame_stream[i].wf_period], dist_wf_period.refs.bit_count);
-		write_bits(&stream_writer, dist_wf_amplitude.map_of_refs[frame_stream[i].wf_amplitude], dist_wf_amplitude.refs.bit_count);
-		write_bits(&stream_writer, dist_adsr_release_start.map_of_refs[frame_stream[i].adsr_release_start], dist_adsr_release_start.refs.bit_count);
+		if (!backrefs || !backrefs[i]) {
+			for (int field = 0; field < field_count; field++) {
+				write_ref(&stream_writer, &dists[field], options, symbol_at(syms, field, i));
+			}
+		} else if (backrefs[i] > 0) {
+			// Escape, run length, then bit and byte position of the run
+			int source = positions[sources[i]];
+			write_ref(&stream_writer, &dists[0], options, 0);
+			write_bits(&stream_writer, backrefs[i], STREAM_BACKREF_LENGTH_BITS);
+			write_bits(&stream_writer, source & 7, 3);
+			write_value(&stream_writer, source >> 3, stream->backref_offset_bits);
+		}
+	}
+
+	if (options & STREAM_BACKREF) {
+		// EOF: an escape with zero length
+		write_ref(&stream_writer, &dists[0], options, 0);
+		write_bits(&stream_writer, 0, STREAM_BACKREF_LENGTH_BITS);
+		stream->data_size = stream_writer.pos + (stream_writer.bit_pos > 0);
+	} else if (options & STREAM_END_FRAME) {
+		// EOF: a frame with adsr_time_scale_1 = 0 stops the sequencer, no need to check the stream end
+		write_ref(&stream_writer, &dists[0], options, 0);
+		for (int field = 1; field < field_count; field++) {
+			write_ref(&stream_writer, &dists[field], options, dists[field].refs.values[0]);
+		}
+		stream->data_size = stream_writer.pos + (stream_writer.bit_pos > 0);
+	} else {
+		// EOF. The risk is that a valid note close to the stream end has all refs = 0. However this is only a filler to be discarded when the pointer reaches the end
+		for (int i = 0; i < 2; i++) {
+			for (int field = 0; field < field_count; field++) {
+				write_bits(&stream_writer, 0, dists[field].refs.bit_count);
+			}
+		}
 	}
 
-	// EOF. The risk is that a valid note close to the stream end has all refs = 0. However this is only a filler to be discarded when the pointer reaches the end
-	for (int i = 0; i < 2; i++) {
-		write_bits(&stream_writer, 0, dist_adsr_time_scale.refs.bit_count);
-		write_bits(&stream_writer, 0, dist_wf_period.refs.bit_count);
-		write_bits(&stream_writer, 0, dist_wf_amplitude.refs.bit_count);
-		write_bits(&stream_writer, 0, dist_adsr_release_start.refs.bit_count);
+cleanup:
+	for (int field = 0; field < field_count; field++) {
+		distribution_free(&dists[field]);
 	}
+	free(values);
+	free(backrefs);
+	free(sources);
+	free(positions);
+	return err;
+}
 
+/*! Value of the `field`-th frame field (in stream order) */
+static int frame_field(const struct seq_frame_t* frame, int field) {
+	switch (field) {
+		case 0:
+			return frame->adsr_time_scale_1;
+		case 1:
+			return frame->wf_period;
+		case 2:
+			return frame->wf_amplitude;
+		case 3:
+			return frame->adsr_release_start;
+		case 4:
+#ifdef WAVEFORM_TYPES
+			return frame->wf_type;
+#else
+			return WF_SQUARE;
+#endif
+		default:
+#ifdef WAVEFORM_RAMPS
+			return frame->wf_step;
+#else
+			return 0;
+#endif
+	}
+}
+
+/*! Per-field layout: the field refs are coded in sequence */
+static int stream_compress_fields(const struct seq_frame_t* frame_stream, int frame_count, int options, struct bit_stream_t* stream) {
+	struct stream_symbols_t syms = { STREAM_FIELD_COUNT, frame_count, malloc(sizeof(int) * (frame_count * STREAM_FIELD_COUNT + 1)) };
+	for (int field = 0; field < STREAM_FIELD_COUNT; field++) {
+		for (int i = 0; i < frame_count; i++) {
+			syms.symbols[field * frame_count + i] = frame_field(frame_stream + i, field);
+		}
+	}
+
+	struct ref_map_t refs[STREAM_FIELD_COUNT];
+	int err = stream_encode(&syms, options & ~STREAM_TUPLES, stream, refs);
+	free(syms.symbols);
+	stream->refs_adsr_time_scale = refs[0];
+	stream->refs_wf_period = refs[1];
+	stream->refs_wf_amplitude = refs[2];
+	stream->refs_adsr_release_start = refs[3];
+	stream->refs_wf_type = refs[4];
+	stream->refs_wf_step = refs[5];
+	memset(&stream->refs_frame, 0, sizeof(struct ref_map_t));
+	return err;
+}
+
+static int frame_compare(const void* a, const void* b) {
+	const struct seq_frame_t* x = a;
+	const struct seq_frame_t* y = b;
+	for (int field = 0; field < STREAM_FIELD_COUNT; field++) {
+		int diff = frame_field(x, field) - frame_field(y, field);
+		if (diff) {
+			return diff;
+		}
+	}
 	return 0;
 }
 
+/*!
+ * Sorted table of the distinct frames in `tuples` (to free), after the escape tuple with a zero time scale.
+ * Returns the count of tuples.
+ */
+static int frame_tuples(const struct seq_frame_t* frame_stream, int frame_count, struct seq_frame_t** tuples_out) {
+	struct seq_frame_t* tuples = malloc(sizeof(struct seq_frame_t) * (frame_count + 1));
+	memset(&tuples[0], 0, sizeof(struct seq_frame_t));
+	memcpy(tuples + 1, frame_stream, sizeof(struct seq_frame_t) * frame_count);
+	qsort(tuples + 1, frame_count, sizeof(struct seq_frame_t), frame_compare);
+	int tuple_count = 1;
+	for (int i = 1; i <= frame_count; i++) {
+		if (frame_compare(&tuples[i], &tuples[tuple_count - 1])) {
+			tuples[tuple_count++] = tuples[i];
+		}
+	}
+	*tuples_out = tuples;
+	return tuple_count;
+}
+
+/*!
+ * Tuple layout: a single ref per frame, in the table of the distinct frames.
+ * The field ref maps are the columns of the table. The first tuple is the escape, with a zero time scale.
+ */
+static int stream_compress_tuples(const struct seq_frame_t* frame_stream, int frame_count, int options, struct bit_stream_t* stream) {
+	struct seq_frame_t* tuples;
+	int tuple_count = frame_tuples(frame_stream, frame_count, &tuples);
+	if (tuple_count > 256) {
+		free(tuples);
+		return 1;
+	}
+
+	struct stream_symbols_t syms = { 1, frame_count, malloc(sizeof(int) * (frame_count + 1)) };
+	for (int i = 0; i < frame_count; i++) {
+		const struct seq_frame_t* tuple = bsearch(&frame_stream[i], tuples, tuple_count, sizeof(struct seq_frame_t), frame_compare);
+		syms.symbols[i] = (int)(tuple - tuples);
+	}
+
+	int err = stream_encode(&syms, options | STREAM_TUPLES, stream, &stream->refs_frame);
+	free(syms.symbols);
+
+	// Columns of the table, in ref order
+	struct ref_map_t* columns[STREAM_FIELD_COUNT] = { &stream->refs_adsr_time_scale, &stream->refs_wf_period, &stream->refs_wf_amplitude, &stream->refs_adsr_release_start, &stream->refs_wf_type, &stream->refs_wf_step };
+	for (int field = 0; field < STREAM_FIELD_COUNT; field++) {
+		memset(columns[field], 0, sizeof(struct ref_map_t));
+		columns[field]->count = stream->refs_frame.count;
+		columns[field]->values = malloc(sizeof(int) * (stream->refs_frame.count + 1));
+		for (int i = 0; i < stream->refs_frame.count; i++) {
+			columns[field]->values[i] = frame_field(&tuples[stream->refs_frame.values[i]], field);
+		}
+	}
+	free(tuples);
+	return err;
+}
+
+/*! Size of a generated table, in bytes */
+static int ref_map_size(const struct ref_map_t* refs, int value_size) {
+	return refs->count * value_size + (refs->code_counts ? refs->bit_count : 0);
+}
+
+int stream_wf_types(const struct bit_stream_t* stream) {
+	int types = 0;
+	for (int i = 0; i < stream->refs_wf_type.count; i++) {
+		types |= 1 << stream->refs_wf_type.values[i];
+	}
+	return types;
+}
+
+int stream_field_count(const struct bit_stream_t* stream) {
+	int types = stream_wf_types(stream);
+	if (types & ((1 << WF_SAWTOOTH) | (1 << WF_TRIANGLE))) {
+		return STREAM_FIELD_COUNT;
+	}
+	// Square-only tunes don't code the generator
+	return (types & ~(1 << WF_SQUARE)) ? STREAM_FIELD_COUNT - 1 : STREAM_FIELD_COUNT - 2;
+}
+
+int stream_envelope_count(const struct bit_stream_t* stream) {
+	const struct ref_map_t* refs = &stream->refs_adsr_release_start;
+	int has_shapes = 0;
+	int envelope_count = 0;
+	for (int i = 0; i < refs->count; i++) {
+		has_shapes |= (refs->values[i] >> ADSR_SHAPE_SHIFT) != ADSR_SHAPE_DEFAULT;
+		// Tuple tables can repeat the values
+		int j = 0;
+		while (j < i && refs->values[j] != refs->values[i]) {
+			j++;
+		}
+		envelope_count += j == i;
+	}
+	return has_shapes ? envelope_count : 0;
+}
+
+/*! Program memory used by the stream and its tables, in bytes */
+static int stream_footprint(const struct bit_stream_t* stream) {
+	return stream->data_size + 
+		ref_map_size(&stream->refs_adsr_time_scale, 2) +
+		ref_map_size(&stream->refs_wf_period, 2) +
+		ref_map_size(&stream->refs_wf_amplitude, 1) +
+		ref_map_size(&stream->refs_adsr_release_start, 1) +
+		// Square-only tunes don't use the generator table, nor the ramp steps without ramps
+		(stream_field_count(stream) > STREAM_FIELD_COUNT - 2 ? ref_map_size(&stream->refs_wf_type, 1) : 0) +
+		(stream_field_count(stream) > STREAM_FIELD_COUNT - 1 ? ref_map_size(&stream->refs_wf_step, 2) : 0) +
+		// The envelope gain rows, if emitted
+		stream_envelope_count(stream) * ADSR_ENV_LENGTH +
+		ref_map_size(&stream->refs_frame, 0);
+}
+
+static void ref_map_print(FILE* log, const struct ref_map_t* refs, const char* name, int frame_count, int options) {
+	fprintf(log, "\t%s: ", name);
+	if (options & STREAM_HUFFMAN) {
+		fprintf(log, "%d (%d bits max, %.2f avg)\n", refs->count, refs->bit_count, frame_count ? (double)refs->total_bits / frame_count : 0.0);
+	} else {
+		fprintf(log, "%d (%d bits)\n", refs->count, refs->bit_count);
+	}
+}
+
+int stream_pack(struct seq_frame_t* frame_stream, int frame_count, int options, FILE* log, struct bit_stream_t* stream) {
+	int err;
+	if (options & STREAM_TUPLES) {
+		err = stream_compress_tuples(frame_stream, frame_count, options, stream);
+	} else if (options & STREAM_FIELDS) {
+		err = stream_compress_fields(frame_stream, frame_count, options, stream);
+	} else {
+		// Keep the smaller layout
+		struct bit_stream_t by_tuples;
+		err = stream_compress_fields(frame_stream, frame_count, options, stream);
+		if (!err && !stream_compress_tuples(frame_stream, frame_count, options, &by_tuples)) {
+			if (log) {
+				fprintf(log, "Layout: fields %d bytes, tuples %d bytes\n", stream_footprint(stream), stream_footprint(&by_tuples));
+			}
+			if (stream_footprint(&by_tuples) < stream_footprint(stream)) {
+				stream_free(stream);
+				*stream = by_tuples;
+			} else {
+				stream_free(&by_tuples);
+			}
+		}
+	}
+	return err;
+}
+
+void stream_print(const struct bit_stream_t* stream, int frame_count, FILE* log) {
+	fprintf(log, "Distribution chart for %d frames:\n", frame_count);
+	if (stream->options & STREAM_TUPLES) {
+		ref_map_print(log, &stream->refs_frame, "frame tuples", frame_count, stream->options);
+	} else {
+		ref_map_print(log, &stream->refs_adsr_time_scale, "adsr_time_scale", frame_count, stream->options);
+		ref_map_print(log, &stream->refs_wf_period, "wf_period", frame_count, stream->options);
+		ref_map_print(log, &stream->refs_wf_amplitude, "wf_amplitude", frame_count, stream->options);
+		ref_map_print(log, &stream->refs_adsr_release_start, "adsr_release_start", frame_count, stream->options);
+		ref_map_print(log, &stream->refs_wf_type, "wf_type", frame_count, stream->options);
+		ref_map_print(log, &stream->refs_wf_step, "wf_step", frame_count, stream->options);
+	}
+	if (stream->options & STREAM_BACKREF) {
+		fprintf(log, "Back-references: %d\n", stream->backref_count);
+	}
+	fprintf(log, "Stream size: %d bytes\n", stream->data_size);
+}
+
+int stream_compress(struct seq_frame_t* frame_stream, int frame_count, int options, FILE* log, struct bit_stream_t* stream) {
+	if (options & STREAM_TUPLES) {
+		struct seq_frame_t* tuples;
+		int tuple_count = frame_tuples(frame_stream, frame_count, &tuples);
+		free(tuples);
+		if (tuple_count > 256) {
+			fprintf(stderr, "Warning: %d frame tuples don't fit in 8 bit refs, using the fields layout\n", tuple_count);
+			options = (options & ~STREAM_TUPLES) | STREAM_FIELDS;
+		}
+	}
+	int err = stream_pack(frame_stream, frame_count, options, log, stream);
+	if (!err && log) {
+		stream_print(stream, frame_count, log);
+	}
+	return err;
+}
+
+/*! Cycles of a constant shift of a byte: the shifts over 4 start with a nibble swap */
+static int shift_cycles(int shift) {
+	return shift > 4 ? shift - 3 : shift;
+}
+
+void stream_cost(const struct bit_stream_t* stream, int frame_count, int voice_count, const struct stream_cost_model_t* model, struct stream_cost_t* cost) {
+	const struct ref_map_t* columns[STREAM_FIELD_COUNT] = { &stream->refs_adsr_time_scale, &stream->refs_wf_period, &stream->refs_wf_amplitude, &stream->refs_adsr_release_start, &stream->refs_wf_type, &stream->refs_wf_step };
+	int field_count = stream_field_count(stream);
+	int huffman = stream->options & STREAM_HUFFMAN;
+	int unrolled = (stream->options & SEQ_CODEGEN_UNROLL) && !(stream->options & (STREAM_HUFFMAN | STREAM_BACKREF));
+
+	// Refs read per frame: the tuple, or the fields with more than a value
+	const struct ref_map_t* reads[STREAM_FIELD_COUNT];
+	int read_count = 0;
+	if (stream->options & STREAM_TUPLES) {
+		reads[read_count++] = &stream->refs_frame;
+	} else {
+		for (int i = 0; i < field_count; i++) {
+			if (columns[i]->bit_count) {
+				reads[read_count++] = columns[i];
+			}
+		}
+	}
+
+	// Fixed cost, and the table lookups of the frame fields (16-bit time scale and period)
+	int fixed = model->frame + model->lookup * (field_count + 2);
+	double cycles = fixed;
+	int worst_cycles = fixed;
+	int code = unrolled ? model->code_unrolled : model->code_fixed;
+	if (huffman) {
+		code += model->code_huffman;
+		for (int i = 0; i < read_count; i++) {
+			cycles += model->code_bit * (frame_count ? (double)reads[i]->total_bits / frame_count : 0.0);
+			worst_cycles += model->code_bit * reads[i]->bit_count;
+		}
+	} else {
+		// The fixed-size frames start at a cycle of bit phases
+		int frame_bits = 0;
+		for (int i = 0; i < read_count; i++) {
+			frame_bits += reads[i]->bit_count;
+		}
+		int phase = 0;
+		int phase_count = 0;
+		double phase_cycles = 0;
+		int phase_worst = 0;
+		do {
+			int offset = phase;
+			int frame_cycles = 0;
+			for (int i = 0; i < read_count; i++) {
+				int shift = offset % 8;
+				if (unrolled) {
+					frame_cycles += model->field_unrolled + shift_cycles(shift);
+					if (shift + reads[i]->bit_count > 8) {
+						frame_cycles += shift_cycles(8 - shift);
+					}
+				} else {
+					// `read_bits` shifts the 16-bit buffer by the bit position
+					frame_cycles += model->field + model->shift_bit * shift;
+				}
+				offset += reads[i]->bit_count;
+			}
+			phase_cycles += frame_cycles;
+			if (frame_cycles > phase_worst) {
+				phase_worst = frame_cycles;
+			}
+			phase_count++;
+			phase = (phase + frame_bits) % 8;
+		} while (phase);
+		cycles += phase_cycles / phase_count;
+		worst_cycles += phase_worst;
+		if (unrolled) {
+			code += model->code_unrolled_field * read_count * phase_count;
+		}
+	}
+	if (stream->options & STREAM_BACKREF) {
+		code += model->code_backref;
+		cycles += frame_count ? (double)model->backref * stream->backref_count / frame_count : 0.0;
+		worst_cycles += model->backref;
+	}
+	if (stream->options & SEQ_CODEGEN_UNROLL) {
+		// The feed loop, unrolled for the voices
+		code += model->code_feed_voice * voice_count - model->code_feed;
+	}
+
+	// Data: a program word per byte (`retlw` tables)
+	cost->words = code + stream_footprint(stream);
+	cost->cycles = cycles;
+	cost->worst_cycles = worst_cycles;
+}
+
 void stream_free(struct bit_stream_t* stream) {
 	free(stream->data);
 	free(stream->refs_adsr_time_scale.values);
 	free(stream->refs_wf_period.values);
 	free(stream->refs_wf_amplitude.values);
 	free(stream->refs_adsr_release_start.values);
+	free(stream->refs_wf_type.values);
+	free(stream->refs_wf_step.values);
+	free(stream->refs_frame.values);
+	free(stream->refs_adsr_time_scale.code_counts);
+	free(stream->refs_wf_period.code_counts);
+	free(stream->refs_wf_amplitude.code_counts);
+	free(stream->refs_adsr_release_start.code_counts);
+	free(stream->refs_wf_type.code_counts);
+	free(stream->refs_wf_step.code_counts);
+	free(stream->refs_frame.code_counts);
 }
-
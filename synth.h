@@ -39,6 +39,71 @@ struct poly_synth_t {
 	struct voice_ch_t voice[VOICE_COUNT];
 };
 
+#ifdef SEQ_REENTRANT
+#ifdef SEQ_CHANNEL_COUNT
+#error "SEQ_CHANNEL_COUNT is not supported by reentrant builds"
+#endif
+
+/*!
+ * Synth and sequencer state, used instead of the globals in reentrant builds.
+ */
+struct seq_ctx_t {
+	/*! The voices */
+	struct poly_synth_t synth;
+	/*! The voice being computed */
+	struct voice_ch_t* cur_voice;
+	/*! The frame written by `new_frame_require` */
+	struct seq_frame_t seq_buf_frame;
+	/*! Set at the stream end */
+	uint8_t seq_end;
+	/*! Voices in use */
+	uint8_t seq_voice_count;
+#ifdef SEQ_FEED_COMPENSATE
+	/*! Compensate the late frame feeds: the stream was compiled with `SEQ_COMPILE_COMPENSATE` */
+	uint8_t feed_compensate;
+#endif
+#ifdef CHECK_CLIPPING
+	/*! Count of clipped samples */
+	int clip_count;
+#endif
+	/*! Requires a new frame to be written in `seq_buf_frame`. The call never fails. */
+	void (*new_frame_require)(struct seq_ctx_t* ctx);
+	/*! State of the frame source, for `new_frame_require` */
+	void* frame_source;
+};
+
+/*! Reset the context, with all the voices ended, and set the frame source */
+void seq_ctx_init(struct seq_ctx_t* ctx, void (*new_frame_require)(struct seq_ctx_t* ctx), void* frame_source);
+#else
 extern struct poly_synth_t synth;
 
+#ifdef CHECK_CLIPPING
+extern int clip_count;
+#endif
+#endif
+
+#ifdef SEQ_REENTRANT
+#define SEQ_FEED_COMPENSATE_ON (ctx->feed_compensate)
+#else
+// Defined by the tune, compiled for it
+#define SEQ_FEED_COMPENSATE_ON 1
+#endif
+
+/*!
+ * Compute the next voice channel sample.
+ * Defined here, since it requires the complete engine state.
+ */
+inline static int8_t voice_ch_next(SEQ_CTX_PARAM) {
+	adsr_next(SEQ_CTX_ARG);
+	uint8_t gain = SEQ_CTX cur_voice->adsr.gain;
+	if (gain >= 6) {
+		return 0;
+	}
+
+	int8_t value = voice_wf_next(SEQ_CTX_ARG);
+	value >>= gain;
+
+	return value;
+}
+
 #endif
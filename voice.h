@@ -37,22 +37,17 @@ struct voice_ch_t {
 	struct voice_wf_gen_t wf;
 };
 
+#ifndef SEQ_REENTRANT
 extern struct voice_ch_t* cur_voice;
+#endif
 
+#ifdef VOICE_MIX_SIMD
 /*!
- * Compute the next voice channel sample.
+ * Mix `count` samples of `voice_count` voices in `mix`, using the SIMD implementation
+ * of the port. None of the voices must reach the end of the envelope in the meantime.
+ * Bit-exact with `voice_ch_next()`.
  */
-inline static int8_t voice_ch_next() {
-	adsr_next();
-	uint8_t gain = cur_voice->adsr.gain;
-	if (gain >= 6) {
-		return 0;
-	}
-
-	int8_t value = voice_wf_next();
-	value >>= gain;
-
-	return value;
-}
+void voice_mix_simd(SEQ_CTX_PARAM_ struct voice_ch_t* voices, uint8_t voice_count, int16_t* mix, uint16_t count);
+#endif
 
 #endif
\ No newline at end of file
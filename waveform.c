@@ -22,35 +22,155 @@
 #include "synth.h"
 #include <stdlib.h>
 
-/*!
- * Number of fractional bits for `period` and `period_remain`.
- * This allows tuned notes even in lower sampling frequencies.
- * The integer part (12 bits) is wide enough to render a 20Hz 
- * note on the higher 48kHz sampling frequency.
- */
-#define PERIOD_FP_SCALE 	(4)
+#ifdef WAVEFORM_TYPES
+/*! Initial state of the noise LFSR: the same pattern for every note */
+#define NOISE_LFSR_SEED		0xACE1u
+
+/*! Event at every half period: swap the square value, resync the ramps, or step the noise */
+static void voice_wf_half_period(struct voice_wf_gen_t* wf) {
+	switch (wf->type) {
+#ifdef WAVEFORM_SAWTOOTH
+		case WF_SAWTOOTH:
+			// The ramp spans two half periods: the amplitude sign toggles, and restarts the ramp at the end
+			wf->int_amplitude = -wf->int_amplitude;
+			if (wf->int_amplitude < 0) {
+				wf->ramp = -(-wf->int_amplitude << 8);
+			}
+			break;
+#endif
+#ifdef WAVEFORM_TRIANGLE
+		case WF_TRIANGLE:
+			// Reverse the ramp, from the exact peak
+			wf->step = -wf->step;
+			wf->ramp = wf->step > 0 ? -(wf->int_amplitude << 8) : (wf->int_amplitude << 8);
+			break;
+#endif
+#ifdef WAVEFORM_NOISE
+		case WF_NOISE:
+			// Galois LFSR, x^16 + x^14 + x^13 + x^11 + 1
+			wf->lfsr = (wf->lfsr & 1) ? ((wf->lfsr >> 1) ^ 0xB400u) : (wf->lfsr >> 1);
+			wf->int_sample = (wf->lfsr & 1) ? wf->int_amplitude : -wf->int_amplitude;
+			break;
+#endif
+		default:
+			wf->int_sample = -wf->int_sample;
+			break;
+	}
+}
+
+/*! Next sample of any generator. Additions and shifts only */
+static inline int8_t voice_wf_step(struct voice_wf_gen_t* wf) {
+	if (wf->period > 0) {
+		if ((wf->period_remain >> PERIOD_FP_SCALE) == 0) {
+			voice_wf_half_period(wf);
+			wf->period_remain += wf->period;
+		}
+		wf->period_remain -= (1 << PERIOD_FP_SCALE);
+#ifdef WAVEFORM_RAMPS
+		if (wf->step) {
+			// The integer part of the 8.8 ramp
+			wf->int_sample = (int8_t)(wf->ramp >> 8);
+			wf->ramp += wf->step;
+		}
+#endif
+	}
+	return wf->int_sample;
+}
+#endif
 
-int8_t voice_wf_next() {
-	if (cur_voice->wf.period > 0) {
-		if ((cur_voice->wf.period_remain >> PERIOD_FP_SCALE) == 0) {
+int8_t voice_wf_next(SEQ_CTX_PARAM) {
+#ifdef WAVEFORM_TYPES
+	return voice_wf_step(&SEQ_CTX cur_voice->wf);
+#else
+	if (SEQ_CTX cur_voice->wf.period > 0) {
+		if ((SEQ_CTX cur_voice->wf.period_remain >> PERIOD_FP_SCALE) == 0) {
 			/* Swap value */
-			cur_voice->wf.int_sample = -cur_voice->wf.int_sample;
-			cur_voice->wf.period_remain += cur_voice->wf.period;
+			SEQ_CTX cur_voice->wf.int_sample = -SEQ_CTX cur_voice->wf.int_sample;
+			SEQ_CTX cur_voice->wf.period_remain += SEQ_CTX cur_voice->wf.period;
 		}
-		cur_voice->wf.period_remain -= (1 << PERIOD_FP_SCALE);
+		SEQ_CTX cur_voice->wf.period_remain -= (1 << PERIOD_FP_SCALE);
 	}
-	return cur_voice->wf.int_sample;
+	return SEQ_CTX cur_voice->wf.int_sample;
+#endif
 }
 
+#ifdef SEQ_BLOCK_SIZE
+void voice_wf_render(struct voice_wf_gen_t* wf, int16_t* mix, uint16_t count, uint8_t gain) {
+#ifdef WAVEFORM_TYPES
+	if (wf->type != WF_SQUARE && wf->period > 0) {
+		for (; count; count--) {
+			*(mix++) += (int8_t)(voice_wf_step(wf) >> gain);
+		}
+		return;
+	}
+#endif
+	int8_t sample = wf->int_sample;
+	if (wf->period > 0) {
+		uint16_t period = wf->period;
+		uint16_t period_remain = wf->period_remain;
+		for (; count; count--) {
+			if ((period_remain >> PERIOD_FP_SCALE) == 0) {
+				/* Swap value */
+				sample = -sample;
+				period_remain += period;
+			}
+			period_remain -= (1 << PERIOD_FP_SCALE);
+			*(mix++) += (int8_t)(sample >> gain);
+		}
+		wf->int_sample = sample;
+		wf->period_remain = period_remain;
+	} else {
+		int8_t value = sample >> gain;
+		for (; count; count--) {
+			*(mix++) += value;
+		}
+	}
+}
+#endif
+
 /* Compute frequency period (full wave) */
 uint16_t voice_wf_freq_to_period(uint16_t freq) {
 	/* Use 16-bit 12.4 fixed point */  
 	return (uint16_t)(((uint32_t)synth_freq << PERIOD_FP_SCALE) / freq);
 }
 
-void voice_wf_set(struct seq_frame_t* const frame) {
-	cur_voice->wf.int_sample = cur_voice->wf.int_amplitude = frame->wf_amplitude;
-	cur_voice->wf.period_remain = cur_voice->wf.period = frame->wf_period;
+#ifdef WAVEFORM_TYPES
+/*! Setup the generator state of the frame. The ramp steps are precomputed in the frame */
+static void voice_wf_set_type(struct voice_wf_gen_t* wf, struct seq_frame_t* const frame) {
+	wf->type = frame->wf_type;
+	wf->step = 0;
+	switch (frame->wf_type) {
+#ifdef WAVEFORM_SAWTOOTH
+		case WF_SAWTOOTH:
+			// From the middle of the ramp, over a full period
+			wf->int_sample = 0;
+			wf->ramp = 0;
+			wf->step = frame->wf_step;
+			break;
+#endif
+#ifdef WAVEFORM_TRIANGLE
+		case WF_TRIANGLE:
+			// From the bottom peak, over a half period
+			wf->int_sample = -wf->int_amplitude;
+			wf->ramp = -(wf->int_amplitude << 8);
+			wf->step = frame->wf_step;
+			break;
+#endif
+#ifdef WAVEFORM_NOISE
+		case WF_NOISE:
+			wf->lfsr = NOISE_LFSR_SEED;
+			break;
+#endif
+	}
+}
+#endif
+
+void voice_wf_set(SEQ_CTX_PARAM_ struct seq_frame_t* const frame) {
+	SEQ_CTX cur_voice->wf.int_sample = SEQ_CTX cur_voice->wf.int_amplitude = frame->wf_amplitude;
+	SEQ_CTX cur_voice->wf.period_remain = SEQ_CTX cur_voice->wf.period = frame->wf_period;
+#ifdef WAVEFORM_TYPES
+	voice_wf_set_type(&SEQ_CTX cur_voice->wf, frame);
+#endif
 }
 
 int8_t voice_wf_setup_def(struct seq_frame_t* frame, uint16_t frequency, int8_t amplitude) {
@@ -59,3 +179,17 @@ int8_t voice_wf_setup_def(struct seq_frame_t* frame, uint16_t frequency, int8_t
 	frame->wf_period = period;
 	return 1;
 }
+
+#ifdef WAVEFORM_RAMPS
+void voice_wf_setup_step(struct seq_frame_t* frame) {
+	// The sawtooth spans twice the amplitude over a full period, the triangle over a half period
+	uint32_t range = (uint32_t)frame->wf_amplitude << 9;
+	uint32_t samples = frame->wf_type == WF_SAWTOOTH ? (uint32_t)frame->wf_period << 1 : (uint32_t)frame->wf_period;
+	uint32_t step = 0;
+	if ((frame->wf_type == WF_SAWTOOTH || frame->wf_type == WF_TRIANGLE) && frame->wf_amplitude > 0) {
+		// The samples are rounded up, so the ramp never overshoots the range before the resync
+		step = range / ((samples >> PERIOD_FP_SCALE) + 1);
+	}
+	frame->wf_step = step > INT16_MAX ? INT16_MAX : (int16_t)step;
+}
+#endif
@@ -23,6 +23,20 @@
 
 #include "sequencer.h"
 
+/*!
+ * Number of fractional bits for `period` and `period_remain`.
+ * This allows tuned notes even in lower sampling frequencies.
+ * The integer part (12 bits) is wide enough to render a 20Hz 
+ * note on the higher 48kHz sampling frequency.
+ */
+#define PERIOD_FP_SCALE 	(4)
+
+/*! Waveform generators, in `seq_frame_t::wf_type` */
+#define WF_SQUARE	0
+#define WF_SAWTOOTH	1
+#define WF_TRIANGLE	2
+#define WF_NOISE	3
+
 /*!
  * Waveform generator state.  12 bytes.
  */
@@ -40,9 +54,21 @@ struct voice_wf_gen_t {
 	uint16_t period_remain;
 	/*!
 	 * Period duration in samples (12.4 fixed point).
-	 * (Half period for SQUARE and TRIANGLE)
+	 * (Half period for all the generators: the events happen at every half period)
 	 */
 	uint16_t period;
+#ifdef WAVEFORM_TYPES
+	/*! Generator, WF_* */
+	uint8_t type;
+	union {
+		/*! Sawtooth and triangle: the sample in 8.8 fixed point */
+		int16_t ramp;
+		/*! Noise: the LFSR state */
+		uint16_t lfsr;
+	};
+	/*! Sawtooth and triangle: increment of `ramp` per sample (0 for the other generators) */
+	int16_t step;
+#endif
 };
 
 /**
@@ -61,14 +87,28 @@ uint16_t voice_wf_freq_to_period(uint16_t frequency);
 /*!
  * Configure the generator using waveform type and common parameters
  */
-void voice_wf_set(struct seq_frame_t* const frame);
+void voice_wf_set(SEQ_CTX_PARAM_ struct seq_frame_t* const frame);
 
 /*!
  * Retrieve the next sample from the generator.
  */
-int8_t voice_wf_next();
+int8_t voice_wf_next(SEQ_CTX_PARAM);
+
+/*!
+ * Add `count` samples of the generator, attenuated by `gain` bit shifts, to the `mix` buffer.
+ * Same output of `count` calls to `voice_wf_next`. Used by the block renderer.
+ */
+void voice_wf_render(struct voice_wf_gen_t* wf, int16_t* mix, uint16_t count, uint8_t gain);
 
 /*! Setup def */
 int8_t voice_wf_setup_def(struct seq_frame_t* frame, uint16_t frequency, int8_t amplitude);
 
+#ifdef WAVEFORM_RAMPS
+/*!
+ * Compute the ramp increment per sample of the sawtooth and triangle frames (0 for the other generators),
+ * so the synth doesn't divide when the frame is fed. Called by the compiler, after the frame is final.
+ */
+void voice_wf_setup_step(struct seq_frame_t* frame);
+#endif
+
 #endif